@@ -0,0 +1,50 @@
+/*
+ *  Library to generate write files.
+ *
+ *  Benchmark, built by "make bench": makes a document of 100,000 paragraphs,
+ *  alternating their indents and character styles so that it has plenty of
+ *  CHPs and PAPs, and saves it, reporting how long each part took.
+ *
+ *  To count the system calls that the save makes, run it under strace:
+ *
+ *	strace -c -f ./bench bench.wri
+ *
+ *  The optional second argument is the number of paragraphs to make.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "libwrite.h"
+
+#define NPARAS 100000L
+
+int
+main(int argc, char **argv)
+{
+    char *filename = argc > 1 ? argv[1] : "bench.wri";
+    long nparas = argc > 2 ? atol(argv[2]) : NPARAS;
+    long i;
+    clock_t start, built, saved;
+
+    start = clock();
+    for (i = 0; i < nparas; i++) {
+	if (wri_para_indent_left((int) (i % 5) * 100) ||
+	    wri_char_bold((int) (i / 3) & 1) ||
+	    wri_text("A paragraph of text.\n")) {
+	    fprintf(stderr, "bench: can't make the document\n");
+	    return(1);
+	}
+    }
+    built = clock();
+
+    if (wri_save(filename)) {
+	fprintf(stderr, "bench: can't save %s\n", filename);
+	return(1);
+    }
+    saved = clock();
+
+    printf("%ld paragraphs: made in %.3fs, saved in %.3fs of CPU\n", nparas,
+	   (double) (built - start) / CLOCKS_PER_SEC,
+	   (double) (saved - built) / CLOCKS_PER_SEC);
+    return(0);
+}
@@ -4,44 +4,29 @@
  *  Code for treatment of character properties
  *
  *  Includes:
- *	Structure definitions to memorize the PAPs used in the document.
  *	Code to save CHP information in the final Write file.
- *	Internal functions for manipulation of list of CHPs.
+ *	Internal functions for manipulation of the table of CHPs.
  *
  *  Private data:
- *	list of CHPs defined for the text so far
+ *	table of CHP runs defined for the text so far, and the CHPs they use
  *
  *  Copyright 1992 Martin Guy, Via Marzabotto 3, 47036 Riccione - FO, Italy.
  */
 #include <stdio.h>  /* for NULL */
+#include <stdlib.h> /* for free() */
 #include <string.h> /* for memcpy() */
 #include <memory.h> /* for memcpy() */
-#include <malloc.h> /* for free() */
 #include "libwrite.h"	/* Public definitions */
 #include "write.h"	/* Data structures for Write documents */
 #include "defs.h"	/* Definitions internal to the library */
 
-/* Structure definition for linked list of chps. */
-/* NB: For every pair of consecutive elements, cpLim of the first is equal
- * to cpFirst of the second.  This is redundant, yes, but avoids having to
- * track back up the list to know whether the current CHP refers to any
- * characters or not.
- * All elements of the list are mallocked, except the first element, which is
- * static.
- */
-struct lchp {
-    struct lchp *next;	/* Pointer to next element in list */
-    CP cpFirst;		/* Index of first character this CHP refers to */
-    CP cpLim;		/* Index into text, one past the last character that
-			 * this CHP refers to */
-    struct CHP chp;	/* Character properties in full */
-};
-
 /*
  *  Function prototypes
  */
-static struct CHP *new_chp(void);
-static void free_lchps(struct lchp *from);
+static struct CHP *new_chp(wri_doc_t *doc);
+static struct style_key chp_key(struct CHP *chpp);
+static void key_chp(struct style_key key, struct CHP *chpp);
+static void style_chp(struct fkp_source *fsp, unsigned style, char *buf);
 
 /*
  *  Private data
@@ -62,29 +47,31 @@ const struct CHP _wri_default_chp = {
     /* the rest is all 0 */
 };
 
-/* First element of list, with the default CHP values assumed by Write on
+/* The state of the CHPs of a document lives in its struct chp_state:
+ * the runs of text that have been given their CHPs, and the CHPs they use.
+ * The run that is being added to is not in the table: it goes from the end
+ * of the last run in the table up to cpLim, and its properties are in curr.
+ * No two consecutive runs in the table have the same CHP: they are merged
+ * as the runs are added.
+ */
+
+/* The CHP of a new document, with the default values assumed by Write on
  * startup.
  */
-static struct lchp lchp_first = {
-    (struct lchp *) NULL,   /* next */
-    (CP) 0,		    /* cpFirst */
-    (CP) 0,		    /* cpLim */
-    {			    /* chp */
-	0,  /* res1 */
+static const struct CHP startup_chp = {
+    0,	/* res1 */
 
-	0,  /* fBold */
-	0,  /* fItalic */
-	0,  /* ftc: First font, always Arial. */
+    0,	/* fBold */
+    0,	/* fItalic */
+    0,	/* ftc: First font, always Arial. */
 
-	20, /* hps: 10 points, different from the supposed default. */
+    20, /* hps: 10 points, different from the supposed default. */
 
-	/* the rest is all 0 */
-    }
+    /* the rest is all 0 */
 };
 
-static struct lchp *lchp_curr = &lchp_first;	/* Current CHP (the last in the list) */
-/* Easy way to reference the current CHP */
-#define chp_curr (lchp_curr->chp)
+/* Where the current CHP starts */
+#define chp_cpFirst(doc) RUN_CPFIRST(&(doc)->chp.runs, (doc)->chp.runs.n)
 
 /*
  *  Public functions
@@ -92,62 +79,62 @@ static struct lchp *lchp_curr = &lchp_first;	/* Current CHP (the last in the lis
 
 /* Reset to default values (just like the menu option). */
 int
-wri_char_normal()
+wri_char_normal_r(wri_doc_t *doc)
 {
     /* If any of them fail, indicate failure */
     return (
-	wri_char_bold(0) ||
-	wri_char_italic(0) ||
-	wri_char_underline(0) ||
-	wri_char_script(WRI_NORMAL)
+	wri_char_bold_r(doc, 0) ||
+	wri_char_italic_r(doc, 0) ||
+	wri_char_underline_r(doc, 0) ||
+	wri_char_script_r(doc, WRI_NORMAL)
     );
 }
 
 /* Set value of boldness.  Parameter is 0 or 1 */
 int
-wri_char_bold(int value)
+wri_char_bold_r(wri_doc_t *doc, int value)
 {
     /* Check range */
     if (value != 0 && value != 1) return(1);
 
     /* Are we already in bold?	If so, do nothing */
-    if (chp_curr.fBold == (unsigned)value) return(0);
+    if (doc->chp.curr.fBold == (unsigned)value) return(0);
 
     /* Otherwise create new CHP and set property */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.fBold = (unsigned)value;
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.fBold = (unsigned)value;
     return(0);
 }
 
 /* Set value of italicness.  Parameter is 0 or 1 */
 int
-wri_char_italic(int value)
+wri_char_italic_r(wri_doc_t *doc, int value)
 {
     /* Check range */
     if (value != 0 && value != 1) return(1);
 
     /* Are we already in italic?  If so, do nothing */
-    if (chp_curr.fItalic == (unsigned)value) return(0);
+    if (doc->chp.curr.fItalic == (unsigned)value) return(0);
 
     /* Otherwise create new CHP and set property */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.fItalic = (unsigned)value;
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.fItalic = (unsigned)value;
     return(0);
 }
 
 /* Set underlining.  Parameter is 0 or 1 */
 int
-wri_char_underline(int value)
+wri_char_underline_r(wri_doc_t *doc, int value)
 {
     /* Check range */
     if (value != 0 && value != 1) return(1);
 
     /* Are we already in underline?  If so, do nothing */
-    if (chp_curr.fUline == (unsigned)value) return(0);
+    if (doc->chp.curr.fUline == (unsigned)value) return(0);
 
     /* Otherwise create new CHP and set property */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.fUline = (unsigned)value;
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.fUline = (unsigned)value;
     return(0);
 }
 
@@ -155,7 +142,7 @@ wri_char_underline(int value)
  * Set superscript/subscript
  */
 int
-wri_char_script(int value)
+wri_char_script_r(wri_doc_t *doc, int value)
 {
     /* Check validity of parameter */
     switch (value) {
@@ -168,7 +155,7 @@ wri_char_script(int value)
     }
 
     /* Is the value already right? */
-    if (chp_curr.hpsPos == (unsigned)value) return(0);
+    if (doc->chp.curr.hpsPos == (unsigned)value) return(0);
 
     /* When we go from Normal to Scripted mode, Write does a reduce() of
      * the point size, which is restored when you exit that mode.
@@ -176,35 +163,35 @@ wri_char_script(int value)
      * goes no smaller, and the subsequent enlarge() leaves you in 8pt.
      * This is what Write does.
      */
-    if (chp_curr.hpsPos == WRI_NORMAL && value != WRI_NORMAL) {
+    if (doc->chp.curr.hpsPos == WRI_NORMAL && value != WRI_NORMAL) {
 	/* Going into scripted mode */
-	if (wri_char_reduce()) return(1);
-    } else if (chp_curr.hpsPos != WRI_NORMAL && value == WRI_NORMAL) {
+	if (wri_char_reduce_r(doc)) return(1);
+    } else if (doc->chp.curr.hpsPos != WRI_NORMAL && value == WRI_NORMAL) {
 	/* Going out of scripted mode */
-	if (wri_char_enlarge()) return(1);
+	if (wri_char_enlarge_r(doc)) return(1);
     }
 
     /* Otherwise create new CHP and set size */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.hpsPos = (unsigned char)value;
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.hpsPos = (unsigned char)value;
 
     return(0);
 }
 
 /* Select font by name */
 int
-wri_char_font_name(char *font_name)
+wri_char_font_name_r(wri_doc_t *doc, char *font_name)
 {
-    int ftc = _wri_cvt_font_name_to_code(font_name, 0);
+    int ftc = _wri_cvt_font_name_to_code(doc, font_name, 0);
 
     if (ftc == -1) return(1);	/* Fail */
 
     /* Is the font code already right?
-    if (chp_curr.ftc == (FTC)ftc) return(0);
+    if (doc->chp.curr.ftc == (FTC)ftc) return(0);
 
     /* Otherwise create new CHP and set size */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.ftc = (FTC)ftc;
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.ftc = (FTC)ftc;
 
     return(0);
 }
@@ -213,7 +200,7 @@ wri_char_font_name(char *font_name)
  * NB. Value stored in structure is in half-points
  */
 int
-wri_char_font_size(int value)
+wri_char_font_size_r(wri_doc_t *doc, int value)
 {
     unsigned char hps;
 
@@ -224,11 +211,11 @@ wri_char_font_size(int value)
     hps = (unsigned char)(value * 2);
 
     /* Is the size already right?
-    if (chp_curr.hps == hps) return(0);
+    if (doc->chp.curr.hps == hps) return(0);
 
     /* Otherwise create new CHP and set size */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.hps = hps;
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.hps = hps;
 
     return(0);
 }
@@ -249,25 +236,25 @@ static unsigned hps_values[] = {
  * Reduce point size
  */
 int
-wri_char_reduce()
+wri_char_reduce_r(wri_doc_t *doc)
 {
     int i;
 
     /* Write's algorithm for selecting point size is as follows: */
 
     /* If we are already at or beyond the minimum, there is no change */
-    if (chp_curr.hps <= hps_values[0]) return(0);
+    if (doc->chp.curr.hps <= hps_values[0]) return(0);
 
     /* Otherwise change to the next smallest size in the table.
      * More precisely, to the largest value in the table that
      * is less than the current size */
     for (i=N_HPS_VALUES-1; i>=0; i--) {
-	if (hps_values[i] < chp_curr.hps) break;
+	if (hps_values[i] < doc->chp.curr.hps) break;
     }
 
     /* Create new CHP and set size */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.hps = hps_values[i];
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.hps = hps_values[i];
 
     return(0);
 }
@@ -276,25 +263,25 @@ wri_char_reduce()
  * Enlarge point size
  */
 int
-wri_char_enlarge()
+wri_char_enlarge_r(wri_doc_t *doc)
 {
     int i;
 
     /* Write's algorithm for selecting point size is as follows: */
 
     /* If we are already at or beyond the maximum, there is no change */
-    if (chp_curr.hps >= hps_values[N_HPS_VALUES-1]) return(0);
+    if (doc->chp.curr.hps >= hps_values[N_HPS_VALUES-1]) return(0);
 
     /* Otherwise change to the next largest size in the table.
      * More precisely, to the smallest value in the table that
      * is larger than the current size */
     for (i=0; i < N_HPS_VALUES-1; i++) {
-	if (hps_values[i] > chp_curr.hps) break;
+	if (hps_values[i] > doc->chp.curr.hps) break;
     }
 
     /* Create new CHP and set size */
-    if (new_chp() == NULL) return(1); /* Fail */
-    chp_curr.hps = hps_values[i];
+    if (new_chp(doc) == NULL) return(1); /* Fail */
+    doc->chp.curr.hps = hps_values[i];
 
     return(0);
 }
@@ -305,108 +292,57 @@ wri_char_enlarge()
  * never will.
  */
 int
-_wri_chp_special(int x)
+_wri_chp_special(wri_doc_t *doc, int x)
 {
-    if (new_chp() == NULL) return(1);
+    if (new_chp(doc) == NULL) return(1);
 
-    chp_curr.fSpecial = x;
+    doc->chp.curr.fSpecial = x;
     return(0);
 }
 
 /*
- *  Write out character info.  Sets hp->pnPara so that save_pap() knows
- *  how much CHP info there was.
+ *  Put the current CHP in the table, so that it is merged with the
+ *  previous run if they are the same, ready for _wri_plan_chp().
  */
 int
-_wri_save_chp(struct wri_header *hp, FILE *ofp)
+_wri_finish_chp(wri_doc_t *doc)
 {
-    static struct FKP fkp;	/* Page under construction */
-    struct lchp *lchpp; /* pointer to current lchp */
-    char *start_of_props;   /* pointer to start of FPROPs in the page */
-    unsigned int space_left;/* How many bytes between last FOD and first FPROP? */
-
-    if (_wri_seek_to_page(pnChar(*hp), ofp)) return(1);	 /* Fail */
-
-    hp->pnPara = pnChar(*hp);	/* No paragraph info yet */
-
-    /* Initialise page */
-    fkp.fcFirst = PAGESIZE; /* First CHP always starts at character 0 */
-    fkp.cfod = 0;	    /* No FODs in this page yet */
-    start_of_props = &(fkp.cfod);
-    space_left = start_of_props - &(fkp.rgFPROP[0]);
-
-    /* Treat all CHPs... */
-    for (lchpp = &lchp_first; lchpp != NULL; lchpp = lchpp->next) {
-	int cch;	/* how many bytes of the PAP do we need to specify? */
-	struct FOD *fodp;   /* pointer to current FOD for convenience */
-	unsigned total_size;	    /* Space needed to specify this PAP */
-
-	/* Don't bother saving CHPS that don't refer to anything */
-	if (lchpp->cpFirst == lchpp->cpLim) continue;
-
-	/* Work out how much of the CHP we must specify. */
-	cch = _wri_find_cch((char *)&(lchpp->chp), (char *)&_wri_default_chp, sizeof(struct CHP));
-
-	/* If only the first byte differs, this is the default CHP */
-	if (cch <= 1) {
-	    /* default PAP: just the FOD */
-	    total_size = sizeof(struct FOD);
-	} else {
-	    /* FOD with cch bytes and the cch byte prefixed */
-	    total_size = sizeof(struct FOD) + cch + 1;
-	}
-
-	/* If it doesn't fit, write out the current page and start a new one. */
-	if (total_size > space_left) {
-	    if (_wri_write_page((char *)&fkp, ofp)) return(1);
-
-	    hp->pnPara++;   /* One more page of CHP info */
-
-	    /* Re-initialise page */
-	    fkp.fcFirst = lchpp->cpFirst + PAGESIZE;
-	    fkp.cfod = 0;
-	    start_of_props = &(fkp.cfod);
-	    space_left = start_of_props - &(fkp.rgFPROP[0]);
-	}
-
-	/* write in the CHP if not the default CHP */
-	if (cch > 1) {
-	    memcpy((start_of_props-=cch), (char *)&(lchpp->chp), (size_t)cch);
-
-	    /* prefix the properties with cch */
-	    *--start_of_props = (char)cch;
-	}
-
-	/* Now start_of_props points to the FPROP we have just created */
-
-	/* Get convenient pointer to FOD */
-	fodp = &(fkp.rgFOD[fkp.cfod]);
-
-	if (cch > 1) {
-	    /* bfprop is the offset of FPROP from start of FOD array */
-	    fodp->bfprop = start_of_props - fkp.rgFPROP;
-	} else {
-	    /* Default CHP */
-	    fodp->bfprop = 0xFFFF;
-	}
-
-	/* set fcLim, converting from index-into-text to index-into-file */
-	fodp->fcLim = lchpp->cpLim + PAGESIZE;
-
-	/* One more FOD in the page... */
-	fkp.cfod++;
+    return(new_chp(doc) == NULL);
+}
 
-	/* ...and less space */
-	space_left -= total_size;
-    }
+/*
+ *  Plan the FKP pages of character info, to be filled in by _wri_fill_fkp().
+ *  The number of pages tells save.c where the paragraph info starts.
+ *  As for PAPs, runs with the same CHP within a page share one FPROP.
+ *  Call _wri_finish_chp() first.
+ */
+int
+_wri_plan_chp(wri_doc_t *doc, struct fkp_plan *pp)
+{
+    struct fkp_source *fsp = &pp->src;	/* The runs to save */
+
+    fsp->doc = doc;
+    fsp->runs = &doc->chp.runs;
+    fsp->n = doc->chp.runs.n;	/* The current CHP is in the table */
+    fsp->cpLim = doc->chp.cpLim;
+    fsp->style = NO_STYLE;
+    fsp->styles = &doc->chp.styles;
+    fsp->skip_empty = 0;
+    fsp->deflt = (char *) &_wri_default_chp;
+    fsp->size = sizeof(struct CHP);
+    fsp->props = style_chp;
+
+    return(_wri_plan_fkp(pp));
+}
 
-    /* Write final page, if it contains anything */
-    if (fkp.cfod != 0) {
-	_wri_write_page((char *)&fkp, ofp);
-	hp->pnPara++;	/* One more page of CHP info */
-    }
+/* Put a CHP from the table of styles in *buf */
+static void
+style_chp(struct fkp_source *fsp, unsigned style, char *buf)
+{
+    struct CHP *chpp = (struct CHP *) buf;
 
-    return(0);
+    *chpp = _wri_default_chp; /* in case of padding in the structure */
+    key_chp(fsp->styles->key[style], chpp);
 }
 
 /* Internal interface to this module, called from the rest of this library */
@@ -415,81 +351,156 @@ _wri_save_chp(struct wri_header *hp, FILE *ofp)
  * Set the extent of the current CHP, called when user adds text.
  */
 void
-_wri_extend_chp(CP cpLim)
+_wri_extend_chp(wri_doc_t *doc, CP cpLim)
 {
-    lchp_curr->cpLim = cpLim;
+    doc->chp.cpLim = cpLim;
 }
 
 /*
- * Create a new CHP, tagged on to the end of the list, with contents copied
- * from the current settings.
+ * Start a new CHP, putting the current one in the table of runs and leaving
+ * the current settings in place to be modified.
  *
  * If the current CHP doesn't refer to any characters, there is no need to
  * create a new one (otherwise two consecutive changes to the character
- * info would create an unused CHP in the list).
+ * info would create an unused run in the table).  If it is the same as the
+ * CHP of the previous run, as when they turn bold off and on again, that
+ * run is extended to cover its characters instead.
  *
- * Returns the address of the CHP within the new list element.
+ * Returns the address of the new current CHP.
  */
 static struct CHP *
-new_chp()
+new_chp(wri_doc_t *doc)
 {
+    unsigned style;	/* Index of the current CHP in the table of styles */
+
     /* If CHP refers to no chars, no need to create a new one */
-    if (lchp_curr->cpLim == lchp_curr->cpFirst) return(&(lchp_curr->chp));
+    if (doc->chp.cpLim == chp_cpFirst(doc)) return(&doc->chp.curr);
 
-    if (_wri_new_lprop((struct lprop **)&lchp_curr, sizeof(struct lchp)) == NULL) {
+    /* Find the CHP in the table of styles, adding it if it's new. */
+    style = _wri_intern_style(&doc->chp.styles, chp_key(&doc->chp.curr));
+    if (style == NO_STYLE) {
+	doc->error = 1;
 	return(NULL);
     }
 
-    return(&(lchp_curr->chp));
+    if (doc->chp.runs.n > 0 &&
+	doc->chp.runs.style[doc->chp.runs.n - 1] == style) {
+	doc->chp.runs.cpLim[doc->chp.runs.n - 1] = doc->chp.cpLim;
+    } else {
+	if (_wri_add_run(&doc->chp.runs, doc->chp.cpLim, style)) {
+	    doc->error = 1;
+	    return(NULL);
+	}
+    }
+
+    return(&doc->chp.curr);
 }
 
 /*
- *  Free all memory allocated to CHPs and leave pointers as they were at the
- *  start of time, ready to create a new Write document.
+ *  Forget all CHPs and leave pointers as they were at the start of time,
+ *  ready to create a new Write document.  The memory they used is kept for
+ *  the new document.
  */
 int
-_wri_reinit_chp()
+_wri_reinit_chp(wri_doc_t *doc)
 {
-    /* First element is static, not mallocked, so start from second */
-    free_lchps(lchp_first.next);
+    doc->chp.runs.n = 0;
+    _wri_cut_styles(&doc->chp.styles, 0);
 
     /* reset initial CHP */
-    lchp_first.next = NULL;
-    lchp_first.cpFirst = lchp_first.cpLim = (CP) 0;
-    memcpy((char *)&(lchp_first.chp), (char *) &_wri_default_chp, sizeof(struct CHP));
-    /* re-initialise list pointers */
-    lchp_curr = &lchp_first;
+    doc->chp.cpLim = (CP) 0;
+    memcpy((char *)&doc->chp.curr, (char *) &_wri_default_chp,
+	   sizeof(struct CHP));
 
     return(0);
 }
 
-static void
-free_lchps(struct lchp *from)
+/*
+ *  Set up the CHPs of a new document handle, which starts off with the
+ *  CHP that Write has on startup.
+ */
+void
+_wri_init_chp(wri_doc_t *doc)
 {
-    struct lchp *lchpp;
+    _wri_reinit_chp(doc);
+    doc->chp.curr = startup_chp;
+}
 
-    for (lchpp = from; lchpp != NULL; /* re-init in loop body */) {
-	struct lchp *next;
+/* Free the memory used for CHPs, after _wri_reinit_chp() */
+void
+_wri_free_chp(wri_doc_t *doc)
+{
+    _wri_free_runs(&doc->chp.runs);
+    _wri_free_styles(&doc->chp.styles);
+}
 
-	/* Need to keep hold of next pointer because free() may corrupt it */
-	next = lchpp->next;
-	free((char *) lchpp);
-	lchpp = next;
-    }
+/*
+ * Pack the fields of a CHP into a key for the table of styles, and back.
+ * All the fields are kept, so that CHPs read from a file are saved unchanged.
+ */
+static struct style_key
+chp_key(struct CHP *chpp)
+{
+    struct style_key key;
+
+    key.lo = (unsigned long long) chpp->res1
+	| (unsigned long long) chpp->fBold << 8
+	| (unsigned long long) chpp->fItalic << 9
+	| (unsigned long long) chpp->ftc << 10
+	| (unsigned long long) chpp->hps << 16
+	| (unsigned long long) chpp->fUline << 24
+	| (unsigned long long) chpp->fStrike << 25
+	| (unsigned long long) chpp->fDline << 26
+	| (unsigned long long) chpp->fNew << 27
+	| (unsigned long long) chpp->csm << 28
+	| (unsigned long long) chpp->fSpecial << 30
+	| (unsigned long long) chpp->fHidden << 31
+	| (unsigned long long) chpp->ftcXtra << 32
+	| (unsigned long long) chpp->fOutline << 35
+	| (unsigned long long) chpp->fShadow << 36
+	| (unsigned long long) chpp->res2 << 37
+	| (unsigned long long) chpp->hpsPos << 40;
+    key.hi = 0;
+
+    return(key);
+}
+
+static void
+key_chp(struct style_key key, struct CHP *chpp)
+{
+    chpp->res1 = (unsigned) key.lo & 0xFF;
+    chpp->fBold = (unsigned) (key.lo >> 8) & 1;
+    chpp->fItalic = (unsigned) (key.lo >> 9) & 1;
+    chpp->ftc = (unsigned) (key.lo >> 10) & 0x3F;
+    chpp->hps = (unsigned) (key.lo >> 16) & 0xFF;
+    chpp->fUline = (unsigned) (key.lo >> 24) & 1;
+    chpp->fStrike = (unsigned) (key.lo >> 25) & 1;
+    chpp->fDline = (unsigned) (key.lo >> 26) & 1;
+    chpp->fNew = (unsigned) (key.lo >> 27) & 1;
+    chpp->csm = (unsigned) (key.lo >> 28) & 3;
+    chpp->fSpecial = (unsigned) (key.lo >> 30) & 1;
+    chpp->fHidden = (unsigned) (key.lo >> 31) & 1;
+    chpp->ftcXtra = (unsigned) (key.lo >> 32) & 7;
+    chpp->fOutline = (unsigned) (key.lo >> 35) & 1;
+    chpp->fShadow = (unsigned) (key.lo >> 36) & 1;
+    chpp->res2 = (unsigned) (key.lo >> 37) & 7;
+    chpp->hpsPos = (unsigned) (key.lo >> 40) & 0xFF;
 }
 
 /*
  *  Set all character properties to default values
  */
 int
-_wri_set_default_chp()
+_wri_set_default_chp(wri_doc_t *doc)
 {
     /* If already the default, don't bother. */
-    if (memcmp(&chp_curr, &_wri_default_chp, sizeof(struct CHP)) == 0) return(0);
+    if (chp_key(&doc->chp.curr).lo ==
+	chp_key((struct CHP *)&_wri_default_chp).lo) return(0);
 
     /* Otherwise create new CHP and copy in default values */
-    if (new_chp() == NULL) return(1);
-    memcpy((char *)&chp_curr, (char *)&_wri_default_chp, sizeof(struct CHP));
+    if (new_chp(doc) == NULL) return(1);
+    memcpy((char *)&doc->chp.curr, (char *)&_wri_default_chp,
+	   sizeof(struct CHP));
 
     return(0);
 }
@@ -497,23 +508,21 @@ _wri_set_default_chp()
 /*
  *  Save a copy current paragraph properties (used while defining running heads)
  */
-static struct CHP saved_chp;
-
 void
-_wri_preserve_chp()
+_wri_preserve_chp(wri_doc_t *doc)
 {
-    memcpy((char *)&saved_chp, (char *)&chp_curr, sizeof(struct CHP));
+    memcpy((char *)&doc->chp.saved, (char *)&doc->chp.curr, sizeof(struct CHP));
 }
 
 int
-_wri_restore_chp()
+_wri_restore_chp(wri_doc_t *doc)
 {
     /* If nothing has changed, don't bother. */
-    if (memcmp(&chp_curr, &saved_chp, sizeof(struct CHP)) == 0) return(0);
+    if (chp_key(&doc->chp.curr).lo == chp_key(&doc->chp.saved).lo) return(0);
 
     /* Otherwise create new CHP and copy in saved values */
-    if (new_chp() == NULL) return(1);
-    memcpy((char *)&chp_curr, (char *)&saved_chp, sizeof(struct CHP));
+    if (new_chp(doc) == NULL) return(1);
+    memcpy((char *)&doc->chp.curr, (char *)&doc->chp.saved, sizeof(struct CHP));
 
     return(0);
 }
@@ -523,60 +532,181 @@ _wri_restore_chp()
  * end of the list.  The text will follow.
  */
 int
-_wri_append_chp(struct CHP *chpp, CP cpLim)
+_wri_append_chp(wri_doc_t *doc, struct CHP *chpp, CP cpLim)
 {
-    if (memcmp(chpp, &chp_curr, sizeof(struct CHP)) == 0) {
+    if (chp_key(chpp).lo == chp_key(&doc->chp.curr).lo) {
 	/* It's the same as the current CHP - extend current */
     } else {
-	if (new_chp() == NULL) return(1);
-	memcpy(&chp_curr, chpp, sizeof(chp_curr));
+	if (new_chp(doc) == NULL) return(1);
+	memcpy(&doc->chp.curr, chpp, sizeof(doc->chp.curr));
     }
-    _wri_extend_chp(cpLim);
+    _wri_extend_chp(doc, cpLim);
     return(0);
 }
 
 /*
- * Remember current end of CHP chain to restore to this point if the reading
- * of a write document fails.
- * lchp_break points to the NULL pointer at the end of the list.
+ * Append the CHP runs of the fragment <frag> to those of <doc>, whose text
+ * it will follow from <offset>, for wri_splice().  Each different CHP of the
+ * fragment is looked up in <doc>'s table just once, with its font code
+ * translated through <font_map>.  <doc> carries on with the fragment's
+ * current CHP.
+ * If <shift> is not NULL, the fragment is a template whose fields are being
+ * replaced: each value takes the CHP of the first character of its field,
+ * and runs that end inside the field are dropped.  If the fragment ends with
+ * a field, <doc> carries on with the value's CHP instead.
  */
-static struct lchp **lchp_break;
+int
+_wri_splice_chp(wri_doc_t *doc, wri_doc_t *frag, CP offset, int *font_map,
+		struct cp_shift *shift)
+{
+    unsigned *map;	/* Index in doc's table of each of frag's CHPs */
+    unsigned long i;
+    int swallowed = 0;	/* Was the last run dropped? */
 
-/*
- * If the first CHP of the file was the same as the existing CHP,
- * the breakpoint CHP will have had its extent increased.
- * cpLim_break remembers the original extent to be able to restore it.
- */
-static CP cpLim_break;
+    /* Put both current CHPs in their tables */
+    if (new_chp(frag) == NULL || new_chp(doc) == NULL) return(1);
 
-void
-_wri_breakpoint_chp()
-{
-    lchp_break = &(lchp_curr->next);
-    if (*lchp_break != NULL) {
-#ifdef _WINDOWS
-	MessageBox( 0, "_wri_breakpoint_chp: Internal error: end pointer not NULL", "WriteKit in error", MB_OK|MB_ICONSTOP );
-#else
-	fputs("_wri_breakpoint_chp: Internal error: end pointer not NULL\n", stderr);	       
-#endif	    
+    if ((map = _wri_new_style_map(&frag->chp.styles)) == NULL) goto fail;
+
+    for (i = 0; i < frag->chp.runs.n; i++) {
+	unsigned style = frag->chp.runs.style[i];
+	CP cpLim = offset + _wri_shift_cp(shift, frag->chp.runs.cpLim[i]);
+
+	if (map[style] == NO_STYLE) {
+	    struct CHP chp;
+
+	    key_chp(frag->chp.styles.key[style], &chp);
+	    chp.ftc = font_map[chp.ftc];
+	    map[style] = _wri_intern_style(&doc->chp.styles, chp_key(&chp));
+	    if (map[style] == NO_STYLE) goto fail;
+	}
+
+	if (doc->chp.runs.n > 0 &&
+	    doc->chp.runs.cpLim[doc->chp.runs.n - 1] == cpLim) {
+	    /* Swallowed by the value of a field */
+	    swallowed = 1;
+	    continue;
+	}
+	swallowed = 0;
+
+	if (doc->chp.runs.n > 0 &&
+	    doc->chp.runs.style[doc->chp.runs.n - 1] == map[style]) {
+	    doc->chp.runs.cpLim[doc->chp.runs.n - 1] = cpLim;
+	} else {
+	    if (_wri_add_run(&doc->chp.runs, cpLim, map[style])) goto fail;
+	}
     }
+    free((char *) map);
 
-    cpLim_break = lchp_curr->cpLim;
+    if (swallowed) {
+	key_chp(doc->chp.styles.key[doc->chp.runs.style[doc->chp.runs.n - 1]],
+		&doc->chp.curr);
+    } else {
+	doc->chp.curr = frag->chp.curr;
+	doc->chp.curr.ftc = font_map[frag->chp.curr.ftc];
+    }
+    doc->chp.cpLim = offset + _wri_shift_cp(shift, frag->chp.cpLim);
+
+    return(0);
+
+fail:
+    if (map != NULL) free((char *) map);
+    doc->error = 1;
+    return(1);
 }
 
 /*
- * Restore list of CHPs to the point where we set the breakpoint,
- * by freeing the CHPs that we successively allocated, and replacing the
- * NULL pointer.
+ * Remember the current end of the CHP table to restore to this point if the
+ * reading of a write document fails.
+ *
+ * If the first CHP of the file was the same as the current CHP, its extent
+ * will have been increased, and if the current CHP referred to no
+ * characters, it will have been given the properties of the first CHP of
+ * the file.  The last run in the table may also have been extended.
+ * cpLim_break, chp_break and lastLim_break remember the originals to be
+ * able to restore them.
  */
 void
-_wri_rollback_chp()
+_wri_breakpoint_chp(wri_doc_t *doc)
+{
+    doc->chp.runs_break = doc->chp.runs.n;
+    doc->chp.styles_break = doc->chp.styles.n;
+    doc->chp.lastLim_break = doc->chp.runs.n > 0 ?
+	doc->chp.runs.cpLim[doc->chp.runs.n - 1] : (CP) 0;
+    doc->chp.cpLim_break = doc->chp.cpLim;
+    doc->chp.chp_break = doc->chp.curr;
+}
+
+/*
+ * Restore the table of CHPs to the point where we set the breakpoint,
+ * by forgetting the runs and CHPs that were added since then.
+ */
+void
+_wri_rollback_chp(wri_doc_t *doc)
+{
+    doc->chp.runs.n = doc->chp.runs_break;
+    _wri_cut_styles(&doc->chp.styles, doc->chp.styles_break);
+    if (doc->chp.runs.n > 0)
+	doc->chp.runs.cpLim[doc->chp.runs.n - 1] = doc->chp.lastLim_break;
+
+    /* Restore (maybe) modified extent and properties */
+    doc->chp.cpLim = doc->chp.cpLim_break;
+    doc->chp.curr = doc->chp.chp_break;
+}
+
+/*
+ *  The same functions, acting on the default document
+ */
+int
+wri_char_normal(void)
+{
+    return(wri_char_normal_r(_wri_default_doc()));
+}
+
+int
+wri_char_bold(int value)
+{
+    return(wri_char_bold_r(_wri_default_doc(), value));
+}
+
+int
+wri_char_italic(int value)
 {
-    /* Free from the lchp after the breakpoint */
-    free_lchps(*lchp_break);
+    return(wri_char_italic_r(_wri_default_doc(), value));
+}
 
-    *lchp_break = NULL;
+int
+wri_char_underline(int value)
+{
+    return(wri_char_underline_r(_wri_default_doc(), value));
+}
 
-    /* Restore (maybe) incremented extent */
-    lchp_curr->cpLim = cpLim_break;
+int
+wri_char_script(int value)
+{
+    return(wri_char_script_r(_wri_default_doc(), value));
+}
+
+int
+wri_char_font_name(char *font_name)
+{
+    return(wri_char_font_name_r(_wri_default_doc(), font_name));
+}
+
+int
+wri_char_font_size(int value)
+{
+    return(wri_char_font_size_r(_wri_default_doc(), value));
+}
+
+int
+wri_char_reduce(void)
+{
+    return(wri_char_reduce_r(_wri_default_doc()));
+}
+
+int
+wri_char_enlarge(void)
+{
+    return(wri_char_enlarge_r(_wri_default_doc()));
 }
@@ -6,15 +6,227 @@
  */
 
 /*
- *  Generalised structure for lists of CHPS or PAPs.  Must correspond to the
- *  initial members of struct lchp and struct lpap in chp.c and pap.c
+ *  Table of runs of CHPs or PAPs, one column per field.  See prop.c.
+ *  Run i covers the characters from RUN_CPFIRST(rp, i) up to cpLim[i].
  */
-struct lprop {
-    struct lprop *next; /* Pointer to next element in list */
-    CP cpFirst;		/* Index of first character this CHP refers to */
-    CP cpLim;		/* Index into text, one past the last character that
-			 * the property refers to
-			 */
+struct runs {
+    CP *cpLim;		/* Index into text, one past the last character that
+			 * each run refers to */
+    unsigned *style;	/* Index of each run's properties in their table */
+    unsigned long n;	/* Number of runs in the table */
+    unsigned long max;	/* Number of runs there is room for */
+};
+
+#define RUN_CPFIRST(rp, i) ((i) == 0 ? (CP) 0 : (rp)->cpLim[(i) - 1])
+
+/*
+ *  Key identifying a CHP or a PAP: its fields packed into integers in a fixed
+ *  order, so that two sets of properties are the same if their keys are.
+ *  See chp_key() in chp.c and pap_key() in pap.c.  A CHP only needs lo.
+ */
+struct style_key {
+    unsigned long long lo;
+    unsigned long long hi;
+};
+
+#define SAME_KEY(a, b) ((a).lo == (b).lo && (a).hi == (b).hi)
+
+/*
+ *  Table of the different CHPs or PAPs used in the document.  See prop.c.
+ *  When the document is saved, the FPROP of each style is encoded once and
+ *  kept, so that the next save only has to encode the new styles.
+ */
+struct styles {
+    struct style_key *key;	/* The key of each style */
+    unsigned long n;		/* Number of them in the table */
+    unsigned long max;		/* Number there is room for */
+    unsigned *hash;		/* Hash table of indices into key[] */
+    unsigned long hash_size;	/* Number of slots in hash[], a power of 2 */
+    char *fprop;		/* The FPROP of each style, FPROP_MAX bytes */
+    unsigned long nfprops;	/* Number of styles whose FPROP is there */
+    unsigned long maxfprops;	/* Number there is room for */
+};
+
+/* Room for an FPROP: the cch byte and up to a whole PAP */
+#define FPROP_MAX (1 + sizeof(struct PAP))
+
+#define NO_STYLE ((unsigned)-1)	/* Empty hash slot, or failure */
+
+/*
+ *  Pages of the output file, encoded in memory by a module so that they can
+ *  be written once it is known where they go.  See save.c.
+ */
+struct page_buf {
+    char *data;		/* n pages of PAGESIZE bytes */
+    unsigned long n;	/* Number of pages in the buffer */
+    unsigned long max;	/* Number there is room for */
+};
+
+/*
+ *  Runs to be packed into FKP pages by _wri_plan_fkp(), described by the
+ *  module whose properties they have.  See prop.c.
+ */
+struct fkp_source {
+    wri_doc_t *doc;
+    struct runs *runs;	/* The runs to save */
+    unsigned long n;	/* How many: one more than in the table for PAPs */
+    CP cpLim;		/* Where that one more ends */
+    unsigned style;	/* and its style, or styles->n if not in the table */
+    struct styles *styles;	/* The styles of the runs */
+    int skip_empty;	/* Leave out runs of no characters? */
+    char *deflt;	/* The default properties, which need not be stored, */
+    int size;		/* and their size */
+    /* Put the properties of a style, or of the run after the table if it
+     * is styles->n, in *buf */
+    void (*props)(struct fkp_source *fsp, unsigned style, char *buf);
+};
+
+/*
+ *  Which runs of an fkp_source go in which FKP page.  See prop.c.
+ */
+struct fkp_plan {
+    struct fkp_source src;	/* The runs */
+    char extra[FPROP_MAX];	/* FPROP of the run after the table, if its
+				 * style is not in the table */
+    unsigned long *first;	/* First run in each page, and n at the end */
+    unsigned long npages;	/* Number of pages */
+};
+
+/*
+ *  The state of a document being built, which libwrite.h calls wri_doc_t.
+ *  Each module keeps its part of it in a structure of its own, so that
+ *  several documents can be built at the same time, even in different threads.
+ */
+
+/* The text: see text.c */
+struct text_block;
+
+struct text_state {
+    struct text_block *first;	/* Chain of blocks of text */
+    struct text_block *last;
+    FILE *fp;		/* Temporary file for text, or NULL */
+    FC fp_len;		/* Number of bytes of text in the temp file */
+    FC fp_base;		/* Offset of the text in the file */
+    int direct;		/* Is fp the output file? */
+    CP memory;		/* How much text to hold in memory */
+    CP cpMac;		/* Number of bytes of actual text */
+    char last_char_read;	/* Last char read when appending from Write file */
+    int in_rhc;		/* Are we defining a running head code? */
+    int had_normal_text;	/* Have we output non-rhc text yet? */
+    CP cp_break;	/* Where we were at the breakpoint */
+    struct text_block *block_break;
+    size_t used_break;
+    struct text_block *save_block;	/* Where wri_save_step() got to */
+    CP save_cp;		/* and the cp at the start of that block */
+};
+
+/* Character properties: see chp.c */
+struct chp_state {
+    struct runs runs;	/* The runs that have been given their CHPs */
+    struct styles styles;	/* and the CHPs they use */
+    struct CHP curr;	/* The current CHP */
+    CP cpLim;		/* One past the last character it refers to */
+    struct CHP saved;	/* The CHP of the text around a running head */
+    unsigned long runs_break;	/* Where we were at the breakpoint */
+    unsigned long styles_break;
+    CP lastLim_break;
+    CP cpLim_break;
+    struct CHP chp_break;
+};
+
+/* Paragraph properties: see pap.c */
+
+/* What the FPROP of a PAP depends on, besides the PAP itself */
+struct pap_context {
+    struct TBD tbd[itbdmax];	/* The tabstops */
+    int pofp[2];		/* Print header/footer on first page? */
+    unsigned xaLeft;		/* The page margins */
+    unsigned xaRight;
+};
+
+struct pap_state {
+    struct runs runs;	/* The paragraphs that have been ended */
+    struct styles styles;	/* and the PAPs they use */
+    struct PAP curr;	/* The current PAP */
+    CP cpLim;		/* One past the last character of the paragraph */
+    unsigned last;	/* Index of the PAP of the last paragraph in the table */
+    int pofp[2];	/* Print header/footer on first page? */
+    struct TBD tbd[itbdmax];	/* Tabstops to copy into each and every PAP */
+    int nTabs;		/* Number of elements of tbd that are used */
+    struct PAP saved;	/* The PAP of the text around a running head */
+    unsigned long runs_break;	/* Where we were at the breakpoint */
+    unsigned long styles_break;
+    unsigned last_break;
+    struct PAP pap_break;
+    CP cpLim_break;
+    struct pap_context encoded;	/* What the FPROPs in styles were made with */
+};
+
+/* Section properties: see section.c */
+struct section_state {
+    struct SEP sep;	/* Current section info, modifiable by the user */
+    int dxaRight;	/* What the user set, from which the SEP's */
+    int dyaBottom;	/* d[xy]aText and yaFooter are calculated */
+    int dyaFooter;
+};
+
+/* Fonts: see font.c */
+struct font {
+    unsigned char ffid;	    /* font family identifier */
+    char *font_name;	    /* Ascii name of font */
+};
+
+struct font_state {
+    struct font ffntb[MAX_FONTS];	/* Our font face name table */
+    int NFontsUsed;	/* How many slots in it are occupied? */
+};
+
+/*
+ *  Where a document is being saved: a file, a buffer in memory or a function
+ *  of the caller's.  Files and buffers can be written in any order, but the
+ *  caller's function is handed the bytes in order.  See save.c.
+ */
+struct sink {
+    FILE *fp;			/* The output file, or NULL */
+    char *mem;			/* The buffer, if neither of the others */
+    size_t mem_len;		/* and its length */
+    wri_write_fn write_fn;	/* The caller's function, or NULL */
+    void *ctx;			/* and what to pass it */
+    FC written;			/* How many bytes it has been given */
+};
+
+/*
+ *  How the character positions of a template move when its fields are
+ *  replaced by their values: field i runs from first[i] to lim[i] in the
+ *  template, and its value, of len[i] characters, goes at to[i] in the
+ *  merged text, unless kept[i] says that the field was left as it was.
+ *  The fields are in order.  See template.c.
+ */
+struct cp_shift {
+    unsigned long n;	/* Number of fields */
+    CP *first, *lim;	/* Where they are in the template */
+    CP *len, *to;	/* Where their values go */
+    char *kept;		/* Which fields were not replaced */
+};
+
+/* Output file of a document started with wri_begin(), and the save being
+ * done by wri_save_step(), if any: see save.c */
+struct save_job;
+
+struct save_state {
+    FILE *stream_fp;
+    char *stream_name;
+    struct save_job *job;
+};
+
+struct wri_doc {
+    int error;		/* Have we had a fatal error? */
+    struct text_state text;
+    struct chp_state chp;
+    struct pap_state pap;
+    struct section_state section;
+    struct font_state font;
+    struct save_state save;
 };
 
 /*
@@ -22,64 +234,131 @@ struct lprop {
  */
 
 /* In init.c */
-extern int _wri_error;
+int _wri_init_doc(wri_doc_t *doc);
+wri_doc_t *_wri_thread_doc(void);
+
+/*
+ * Storage class for variables that each thread has its own copy of
+ */
+#ifdef _WINDOWS
+# define WRI_THREAD __declspec(thread)
+#else
+# define WRI_THREAD __thread
+#endif
+
+/*
+ * The document that the functions without the _r suffix act on in this
+ * thread: the one given to wri_bind() or, failing that, the thread's own.
+ * A macro, so that the wrappers cost one load of the thread-local pointer.
+ */
+extern WRI_THREAD wri_doc_t *_wri_bound_doc;
+
+#define _wri_default_doc() \
+	(_wri_bound_doc != NULL ? _wri_bound_doc : _wri_thread_doc())
 
 /* In text.c */
-extern CP _wri_cpMac;
-extern char _wri_last_char_read;
-extern int _wri_in_rhc;
-extern int _wri_had_normal_text;
-int _wri_save_text(struct wri_header *hp, FILE *ofp);
-int _wri_reinit_text(void);
-int _wri_append_text(FILE *ifp, CP n_to_read);
-void _wri_breakpoint_text(void);
-void _wri_rollback_text(void);
+int _wri_save_text(wri_doc_t *doc, struct sink *sp);
+int _wri_save_text_part(wri_doc_t *doc, struct sink *sp, CP cp, CP len);
+void _wri_init_text(wri_doc_t *doc);
+int _wri_reinit_text(wri_doc_t *doc);
+int _wri_append_text(wri_doc_t *doc, FILE *ifp, CP n_to_read);
+int _wri_append_text_mem(wri_doc_t *doc, char *buf, CP n_to_read);
+int _wri_direct_text(wri_doc_t *doc, FILE *ofp);
+void _wri_breakpoint_text(wri_doc_t *doc);
+void _wri_rollback_text(wri_doc_t *doc);
+int _wri_splice_text(wri_doc_t *doc, wri_doc_t *frag);
+int _wri_copy_text(wri_doc_t *doc, wri_doc_t *frag);
+int _wri_get_text(wri_doc_t *doc, char *buf);
 
 /* In chp.c */
 extern const struct CHP _wri_default_chp;
-void _wri_extend_chp(CP cpLim);
-int _wri_chp_special(int x);
-int _wri_save_chp(struct wri_header *hp, FILE *ofp);
-int _wri_reinit_chp(void);
-int _wri_set_default_chp(void);
-void _wri_preserve_chp(void);
-int _wri_restore_chp(void);
-int _wri_append_chp(struct CHP *chpp, CP cpLim);
-void _wri_breakpoint_chp(void);
-void _wri_rollback_chp(void);
+void _wri_extend_chp(wri_doc_t *doc, CP cpLim);
+int _wri_chp_special(wri_doc_t *doc, int x);
+int _wri_finish_chp(wri_doc_t *doc);
+int _wri_plan_chp(wri_doc_t *doc, struct fkp_plan *pp);
+void _wri_init_chp(wri_doc_t *doc);
+int _wri_reinit_chp(wri_doc_t *doc);
+void _wri_free_chp(wri_doc_t *doc);
+int _wri_set_default_chp(wri_doc_t *doc);
+void _wri_preserve_chp(wri_doc_t *doc);
+int _wri_restore_chp(wri_doc_t *doc);
+int _wri_append_chp(wri_doc_t *doc, struct CHP *chpp, CP cpLim);
+void _wri_breakpoint_chp(wri_doc_t *doc);
+void _wri_rollback_chp(wri_doc_t *doc);
+int _wri_splice_chp(wri_doc_t *doc, wri_doc_t *frag, CP offset, int *font_map,
+		    struct cp_shift *shift);
 
 /* In pap.c */
-extern struct PAP _wri_default_pap;
-void _wri_set_tabs(struct TBD *rgtbd);
-void _wri_extend_pap(CP cpLim);
-int _wri_new_paragraph(void);
-int _wri_save_pap(struct wri_header *hp, FILE *ofp);
-int _wri_reinit_pap(void);
-int _wri_append_pap(struct PAP *papp, CP cpLim, int is_first_para);
-void _wri_breakpoint_pap(void);
-void _wri_rollback_pap(void);
+extern const struct PAP _wri_default_pap;
+void _wri_set_tabs(wri_doc_t *doc, struct TBD *rgtbd);
+void _wri_extend_pap(wri_doc_t *doc, CP cpLim);
+int _wri_new_paragraph(wri_doc_t *doc);
+int _wri_plan_pap(wri_doc_t *doc, struct fkp_plan *pp);
+int _wri_reinit_pap(wri_doc_t *doc);
+void _wri_free_pap(wri_doc_t *doc);
+int _wri_append_pap(wri_doc_t *doc, struct PAP *papp, CP cpLim, int is_first_para);
+void _wri_breakpoint_pap(wri_doc_t *doc);
+void _wri_rollback_pap(wri_doc_t *doc);
+int _wri_has_rhc(wri_doc_t *doc);
+int _wri_splice_pap(wri_doc_t *doc, wri_doc_t *frag, CP offset,
+		    struct cp_shift *shift);
 
 /* In prop.c */
-struct lprop *_wri_new_lprop(struct lprop **lprop_currp, int lprop_size);
+int _wri_add_run(struct runs *rp, CP cpLim, unsigned style);
+void _wri_free_runs(struct runs *rp);
+unsigned _wri_intern_style(struct styles *sp, struct style_key key);
+int _wri_cut_styles(struct styles *sp, unsigned long n);
+unsigned *_wri_new_style_map(struct styles *sp);
+void _wri_free_styles(struct styles *sp);
 int _wri_find_cch(char *cp1, char *cp2, int max_chars);
+unsigned _wri_find_style(struct styles *sp, struct style_key key);
+void _wri_forget_fprops(struct styles *sp);
+int _wri_plan_fkp(struct fkp_plan *pp);
+void _wri_fill_fkp(struct fkp_plan *pp, char *pages);
+void _wri_fill_fkp_pages(struct fkp_plan *pp, char *pages,
+			 unsigned long from, unsigned long to);
+void _wri_free_fkp(struct fkp_plan *pp);
 
 /* In section.c */
-extern struct SEP _wri_sep;
-void _wri_set_default_sep(void);
-void _wri_user_to_sep(void);
-void _wri_sep_to_user(void);
-int _wri_save_section(struct wri_header *hp, FILE *ofp);
-int _wri_reinit_section(void);
-
+extern const struct SEP _wri_default_sep;
+void _wri_set_default_sep(wri_doc_t *doc);
+void _wri_user_to_sep(wri_doc_t *doc);
+void _wri_sep_to_user(wri_doc_t *doc);
+int _wri_save_section(wri_doc_t *doc, struct wri_header *hp,
+		      struct page_buf *pb);
+int _wri_reinit_section(wri_doc_t *doc);
 
 /* In font.c */
-int _wri_cvt_font_name_to_code(char *font_name, unsigned char ffid);
-int _wri_save_fonts(struct wri_header *hp, FILE *ofp);
-int _wri_reinit_font(void);
+int _wri_cvt_font_name_to_code(wri_doc_t *doc, char *font_name, unsigned char ffid);
+int _wri_save_fonts(wri_doc_t *doc, struct page_buf *pb);
+void _wri_init_font(wri_doc_t *doc);
+int _wri_reinit_font(wri_doc_t *doc);
+
+/* In template.c */
+CP _wri_shift_cp(struct cp_shift *sp, CP cp);
 
 /* In save.c */
-int _wri_seek_to_page(PN n, FILE *fp);
-int _wri_write_page(char *page, FILE *ofp);
+int _wri_reinit_save(wri_doc_t *doc);
+int _wri_seek_to_page(wri_doc_t *doc, PN n, FILE *fp);
+int _wri_sink_write(wri_doc_t *doc, struct sink *sp, FC offset,
+		    char *buf, size_t len);
+int _wri_add_page(struct page_buf *pb, char *page);
+char *_wri_new_pages(struct page_buf *pb, unsigned long n);
+void _wri_free_pages(struct page_buf *pb);
+void _wri_parallel(unsigned long n,
+		   void (*fn)(void *arg, unsigned long from, unsigned long to),
+		   void *arg);
+
+/*
+ * Macros to get and put the 2-byte words of the font table, which are
+ * little-endian and needn't be aligned
+ */
+#define GETWORD(p) \
+	((unsigned) ((unsigned char *)(p))[0] | \
+	 (unsigned) ((unsigned char *)(p))[1] << 8)
+#define PUTWORD(p, w) \
+	(((unsigned char *)(p))[0] = (unsigned char) ((w) & 0xFF), \
+	 ((unsigned char *)(p))[1] = (unsigned char) (((w) >> 8) & 0xFF))
 
 /*
  * Macro to give the minimum of two values, if not already defined
@@ -20,23 +20,9 @@
 #include "write.h"	/* Data structures for Write documents */
 #include "defs.h"	/* Definitions internal to the library */
 
-/* Structure definition for array of font face names. */
-struct font {
-    unsigned char ffid;	    /* font family identifier */
-    char *font_name;	    /* Ascii name of font */
-};
-
-/* Our font face name table */
-static struct font ffntb[MAX_FONTS] = {
-    /* First element of list, the default font */
-    {
-	32,			/* ffid (from a file generate by Write) */
-	"Arial"			/* font_name */
-    }
-};
-
-/* How many slots in the font face name table are occupied? */
-static int NFontsUsed = 1;
+/* The font face name table of a document is its font.ffntb, of which the
+ * first font.NFontsUsed slots are occupied.  The first is the default font.
+ */
 
 /* List of known font name/font family pairs. */
 static struct font font_ffid[] = {
@@ -67,18 +53,19 @@ static struct font font_ffid[] = {
  */
 
 int
-_wri_cvt_font_name_to_code(char *font_name, unsigned char ffid)
+_wri_cvt_font_name_to_code(wri_doc_t *doc, char *font_name, unsigned char ffid)
 {
     int i;
+    struct font *fontp;	/* The new slot in the table */
 
     /* See if it's already in the font face name table */
-    for (i=0; i<NFontsUsed; i++) {
+    for (i=0; i<doc->font.NFontsUsed; i++) {
 	/* Font names are case-independent */
-	if (strcasecmp(ffntb[i].font_name, font_name) == 0) {
+	if (strcasecmp(doc->font.ffntb[i].font_name, font_name) == 0) {
 	    /* Found it! */
 	    /* See whether we have better information now on its ffid */
-	    if (ffntb[i].ffid == 0 && ffid != 0) {
-		ffntb[i].ffid = ffid;
+	    if (doc->font.ffntb[i].ffid == 0 && ffid != 0) {
+		doc->font.ffntb[i].ffid = ffid;
 	    }
 	    /* Return its code */
 	    return(i);
@@ -88,21 +75,23 @@ _wri_cvt_font_name_to_code(char *font_name, unsigned char ffid)
     /* Not found - create new item and return code */
 
     /* But first check that three's space... */
-    if (NFontsUsed >= MAX_FONTS) {
+    if (doc->font.NFontsUsed >= MAX_FONTS) {
 	/* Already using all font slots - return failure */
 	return(-1);
     }
 
+    fontp = &doc->font.ffntb[doc->font.NFontsUsed];
+
     /* Save a copy of the font name */
-    ffntb[NFontsUsed].font_name = malloc(strlen(font_name)+1);
-    if (ffntb[NFontsUsed].font_name == NULL) {
+    fontp->font_name = malloc(strlen(font_name)+1);
+    if (fontp->font_name == NULL) {
 	/* Out of memory */
-	_wri_error = 1;
+	doc->error = 1;
 	return(-1);
     }
-    strcpy(ffntb[NFontsUsed].font_name, font_name);
+    strcpy(fontp->font_name, font_name);
 
-    ffntb[NFontsUsed].ffid = ffid;
+    fontp->ffid = ffid;
 
     if (ffid == 0) {
 	/*
@@ -112,39 +101,36 @@ _wri_cvt_font_name_to_code(char *font_name, unsigned char ffid)
 	for (i=0; i < sizeof(font_ffid)/sizeof(font_ffid[0]); i++) {
 	    if (strcasecmp(font_name, font_ffid[i].font_name) == 0) {
 		/* Found it! Copy font code */
-		ffntb[NFontsUsed].ffid = font_ffid[i].ffid;
+		fontp->ffid = font_ffid[i].ffid;
 		break;
 	    }
 	}
     }
 
-    return(NFontsUsed++);
+    return(doc->font.NFontsUsed++);
 }
 
 /*
- * Save font table.
+ * Save font table, encoding it into pages in <pb>.
  * Strategy: for each font, try to fit it into the current page.  If it won't
- * go, write out the full page and start building a new one.
+ * go, add the full page to <pb> and start building a new one.
  */
 int
-_wri_save_fonts(struct wri_header *hp, FILE *ofp)
+_wri_save_fonts(wri_doc_t *doc, struct page_buf *pb)
 {
     char page[PAGESIZE];    /* page of font info under construction */
-    PN next_page;   /* In which page of the Write file will the next
-			 * page of font information be written? */
     char *cp;		/* Where to write next char in page[] */
     struct font *ffntbp;/* pointer to current font always == &ffntb[i] */
     int i;
 
-    /* Initialise for 1st page */
-    next_page = hp->pnFfntb;	/* As yet no pages of font info output */
-    if (_wri_seek_to_page(next_page, ofp)) return(1);
+    /* Clear the page so that its unused tail doesn't leak stack contents */
+    memset(page, 0, PAGESIZE);
 
     /* Write in cffn at the start */
-    *(int *)page = (int)NFontsUsed;
+    PUTWORD(page, doc->font.NFontsUsed);
     cp = &page[2];	/* FFNs start straight after */
 
-    for (i=0, ffntbp = ffntb; i<NFontsUsed; i++, ffntbp++) {
+    for (i=0, ffntbp = doc->font.ffntb; i<doc->font.NFontsUsed; i++, ffntbp++) {
 	int fnam_len;	/* length of font name, including the nul */
 
 	fnam_len = strlen(ffntbp->font_name) + 1;
@@ -152,26 +138,25 @@ _wri_save_fonts(struct wri_header *hp, FILE *ofp)
 	/* If it'll fit in this page, put it in.  Otherwise write the page out
 	 * and start a fresh one.  We must leave 2 bytes spare at the end for
 	 * the 0xFFFF "more font info on the next page" or the 0 "end of FFNs
-	 * word.  Size of FFN comprises an int, a char and the string.
+	 * word.  Size of FFN comprises a word, a char and the string.
 	 */
 	if ((&page[PAGESIZE] - cp) - 2 < 3 + fnam_len) {
 	    /* Available space is too small.  Create page & write to disk. */
 
 	    /* Indicate that there is more in the next page... */
-	    *(int *)cp = 0xFFFF;
+	    PUTWORD(cp, 0xFFFF);
 
-	    /* Write to output file */
-	    if (_wri_write_page(page, ofp)) return(1);
-
-	    next_page++;
+	    /* Add to the pages */
+	    if (_wri_add_page(pb, page)) return(1);
 
 	    /* And prepare for new page */
+	    memset(page, 0, PAGESIZE);
 	    cp = page;
 	}
 
 	/* cbFfn */
-	*(int *)cp = 1 + fnam_len;
-	cp += sizeof(int);
+	PUTWORD(cp, 1 + fnam_len);
+	cp += 2;
 
 	/* ffid */
 	*cp++ = ffntbp->ffid;
@@ -182,24 +167,32 @@ _wri_save_fonts(struct wri_header *hp, FILE *ofp)
     }
 
     /* Write final page */
-    *(int *)cp = 0;
-    if (_wri_seek_to_page(next_page, ofp) || _wri_write_page(page, ofp)) return(1);
-    next_page++;
-
-    hp->pnMac = next_page;
+    PUTWORD(cp, 0);
+    if (_wri_add_page(pb, page)) return(1);
 
     return(0);
 }
 
+/*
+ * Set up the font table of a new document, with just the default font.
+ */
+void
+_wri_init_font(wri_doc_t *doc)
+{
+    doc->font.ffntb[0].ffid = 32;	/* (from a file generate by Write) */
+    doc->font.ffntb[0].font_name = "Arial";
+    doc->font.NFontsUsed = 1;
+}
+
 int
-_wri_reinit_font()
+_wri_reinit_font(wri_doc_t *doc)
 {
     int i;
 
     /* Free all font names except for the first one, which is static */
-    for (i=1; i<NFontsUsed; i++) free(ffntb[i].font_name);
+    for (i=1; i<doc->font.NFontsUsed; i++) free(doc->font.ffntb[i].font_name);
 
-    NFontsUsed = 1; /* Just the default font */
+    doc->font.NFontsUsed = 1; /* Just the default font */
 
     return(0);
 }
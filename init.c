@@ -1,58 +1,184 @@
 /*
  *  Library to generate write files.
  *
- *  Reinitialise everything and free allocated memory.
+ *  Create, reinitialise and destroy documents, freeing allocated memory.
  *
  *  Copyright 1992 Martin Guy, Via Marzabotto 3, 47036 Riccione - FO, Italy.
  */
 
 #include <stdio.h>
+#include <stdlib.h> /* for malloc() and free() */
+#include <string.h> /* for memset() */
 #include "libwrite.h"	/* Public definitions */
 #include "write.h"	/* Data structures for Write documents */
 #include "defs.h"	/* Definitions internal to the library */
 
-static int reinit_all(void);
+static int reinit_all(wri_doc_t *doc);
 
 /*
- *  Global variable indicates whether we have encountered a fatal error
- *  such as running out of memory, failed disk write ecc.
+ *  The document that the functions without the _r suffix act on.
+ *  Each thread has its own, so that threads can use them independently,
+ *  unless it has bound another one with wri_bind().
  */
-int _wri_error = 0;
+WRI_THREAD wri_doc_t *_wri_bound_doc = NULL;
+static WRI_THREAD struct wri_doc thread_doc;
+static WRI_THREAD int thread_doc_ready = 0;
 
-int wri_err(void)
+/*
+ *  Called by _wri_default_doc() when the thread has no document bound:
+ *  bind the thread's own, setting it up the first time.
+ */
+wri_doc_t *
+_wri_thread_doc()
 {
-    return(_wri_error);
+    if (!thread_doc_ready) {
+	_wri_init_doc(&thread_doc);
+	thread_doc_ready = 1;
+    }
+    return(_wri_bound_doc = &thread_doc);
 }
 
 /*
- *  Set up for new document, freeing any allocated memory and so on
+ *  Make the functions without the _r suffix act on the given document in
+ *  the calling thread, for example to carry on in this thread with a
+ *  document that another thread started.  A document must not be bound to
+ *  two threads at once.
  */
 int
-wri_new()
+wri_bind(wri_doc_t *doc)
 {
-    _wri_error = 0;
+    if (doc == NULL) return(1);
 
-    return(reinit_all());
+    _wri_bound_doc = doc;
+    return(0);
 }
 
-/* For exit, we need to free memory - reinitialize to do this.
- * The temporary file for text is deleted when _wri_reinit_text closes
- * its file pointer.
+/*
+ *  Go back to the calling thread's own document.
  */
 int
-wri_exit()
+wri_unbind()
 {
-    return(reinit_all());
+    _wri_bound_doc = NULL;
+    return(0);
+}
+
+/*
+ *  Set up a new, empty document in the memory provided.
+ */
+int
+_wri_init_doc(wri_doc_t *doc)
+{
+    memset((char *) doc, 0, sizeof(*doc));
+
+    _wri_init_text(doc);
+    _wri_init_chp(doc);
+    _wri_init_font(doc);
+
+    return(_wri_reinit_pap(doc) || _wri_reinit_section(doc));
+}
+
+/*
+ *  Create a new document, to be passed to the _r functions.
+ *  Returns NULL if we are out of memory.
+ */
+wri_doc_t *
+wri_doc_create()
+{
+    wri_doc_t *doc = (wri_doc_t *) malloc(sizeof(*doc));
+
+    if (doc == NULL) return(NULL);
+
+    if (_wri_init_doc(doc)) {
+	free((char *) doc);
+	return(NULL);
+    }
+
+    return(doc);
+}
+
+/*
+ *  Forget a document created by wri_doc_create(), and all the memory it uses.
+ *  If it was started with wri_begin_r() and not finished, its output file is
+ *  removed.
+ */
+void
+wri_doc_destroy(wri_doc_t *doc)
+{
+    if (doc == NULL) return;
+
+    (void) reinit_all(doc);
+
+    _wri_free_chp(doc);
+    _wri_free_pap(doc);
+
+    free((char *) doc);
+}
+
+/*
+ *  Each document remembers whether we have encountered a fatal error
+ *  such as running out of memory, failed disk write ecc.
+ */
+int
+wri_err_r(wri_doc_t *doc)
+{
+    return(doc->error);
+}
+
+/*
+ *  Set up for new document, freeing any allocated memory and so on
+ */
+int
+wri_new_r(wri_doc_t *doc)
+{
+    doc->error = 0;
+
+    return(reinit_all(doc));
 }
 
 static int
-reinit_all()
+reinit_all(wri_doc_t *doc)
 {
     return(
-	_wri_reinit_text() ||
-	_wri_reinit_chp() ||
-	_wri_reinit_pap() ||
-	_wri_reinit_section() ||
-	_wri_reinit_font()
+	_wri_reinit_save(doc) ||
+	_wri_reinit_text(doc) ||
+	_wri_reinit_chp(doc) ||
+	_wri_reinit_pap(doc) ||
+	_wri_reinit_section(doc) ||
+	_wri_reinit_font(doc)
     );
 }
+
+/*
+ *  The same functions, acting on the default document
+ */
+int
+wri_err()
+{
+    return(wri_err_r(_wri_default_doc()));
+}
+
+int
+wri_new()
+{
+    return(wri_new_r(_wri_default_doc()));
+}
+
+/* For exit, we need to free memory - reinitialize to do this, then give back
+ * the memory that is kept for reuse by a new document.
+ * The temporary file for text is deleted when _wri_reinit_text closes
+ * its file pointer.
+ * This acts on the calling thread's current document, so each thread that
+ * used the functions without the _r suffix should call it before it ends.
+ */
+int
+wri_exit()
+{
+    wri_doc_t *doc = _wri_default_doc();
+    int ret = reinit_all(doc);
+
+    _wri_free_chp(doc);
+    _wri_free_pap(doc);
+
+    return(ret);
+}
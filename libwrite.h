@@ -3,6 +3,18 @@
  *  archivi nel formato di Microsoft Write.
  */
 
+#include <stdio.h>	/* for FILE */
+#include <stddef.h>	/* for size_t */
+
+/*
+ *  A document being built.  The functions below act on a default document,
+ *  of which each thread has its own (see wri_bind()); each of them has a
+ *  version with the suffix _r that acts instead on the document given as its
+ *  first parameter, so that a program can build several documents at once,
+ *  in different threads if it likes.
+ */
+typedef struct wri_doc wri_doc_t;
+
 /*
  *  External data
  */
@@ -14,9 +26,20 @@ extern int wri_err();
 /* In init.c */
 extern int wri_new(void);
 extern int wri_exit(void);
+extern wri_doc_t *wri_doc_create(void);
+extern void wri_doc_destroy(wri_doc_t *doc);
+extern int wri_err_r(wri_doc_t *doc);
+extern int wri_new_r(wri_doc_t *doc);
+extern int wri_bind(wri_doc_t *doc);
+extern int wri_unbind(void);
 
 /* In text.c */
-extern int wri_text(char *text);
+extern int wri_text(const char *text);
+extern int wri_text_n(const char *text, size_t len);
+extern int wri_text_memory(long nbytes);
+extern int wri_text_r(wri_doc_t *doc, const char *text);
+extern int wri_text_n_r(wri_doc_t *doc, const char *text, size_t len);
+extern int wri_text_memory_r(wri_doc_t *doc, long nbytes);
 
 /* In chp.c */
 extern int wri_char_normal(void);
@@ -28,6 +51,15 @@ extern int wri_char_font_name(char *font_name);
 extern int wri_char_font_size(int value);
 extern int wri_char_reduce(void);
 extern int wri_char_enlarge(void);
+extern int wri_char_normal_r(wri_doc_t *doc);
+extern int wri_char_bold_r(wri_doc_t *doc, int value);
+extern int wri_char_italic_r(wri_doc_t *doc, int value);
+extern int wri_char_underline_r(wri_doc_t *doc, int value);
+extern int wri_char_script_r(wri_doc_t *doc, int value);
+extern int wri_char_font_name_r(wri_doc_t *doc, char *font_name);
+extern int wri_char_font_size_r(wri_doc_t *doc, int value);
+extern int wri_char_reduce_r(wri_doc_t *doc);
+extern int wri_char_enlarge_r(wri_doc_t *doc);
 
 /* In pap.c */
 extern int wri_para_normal(void);
@@ -44,6 +76,20 @@ extern int wri_doc_pofp(int print);
 extern int wri_doc_tab_set(int position, int decimal);
 extern int wri_doc_tab_clear(int position);
 extern int wri_doc_tab_cancel(void);
+extern int wri_para_normal_r(wri_doc_t *doc);
+extern int wri_para_justify_r(wri_doc_t *doc, int jc);
+extern int wri_para_interline_r(wri_doc_t *doc, int spacing);
+extern int wri_para_indent_left_r(wri_doc_t *doc, int indent);
+extern int wri_para_indent_right_r(wri_doc_t *doc, int indent);
+extern int wri_para_indent_first_r(wri_doc_t *doc, int indent);
+extern int wri_doc_header_r(wri_doc_t *doc);
+extern int wri_doc_footer_r(wri_doc_t *doc);
+extern int wri_doc_return_r(wri_doc_t *doc);
+extern int wri_doc_insert_page_number_r(wri_doc_t *doc);
+extern int wri_doc_pofp_r(wri_doc_t *doc, int print);
+extern int wri_doc_tab_set_r(wri_doc_t *doc, int position, int decimal);
+extern int wri_doc_tab_clear_r(wri_doc_t *doc, int position);
+extern int wri_doc_tab_cancel_r(wri_doc_t *doc);
 
 /* In section.c */
 extern int wri_doc_number_from(int pgnFirst);
@@ -55,13 +101,109 @@ extern int wri_doc_page_width(int width);
 extern int wri_doc_page_height(int height);
 extern int wri_doc_distance_from_top(int distance);
 extern int wri_doc_distance_from_bottom(int distance);
+extern int wri_doc_number_from_r(wri_doc_t *doc, int pgnFirst);
+extern int wri_doc_margin_left_r(wri_doc_t *doc, int margin);
+extern int wri_doc_margin_top_r(wri_doc_t *doc, int margin);
+extern int wri_doc_margin_right_r(wri_doc_t *doc, int margin);
+extern int wri_doc_margin_bottom_r(wri_doc_t *doc, int margin);
+extern int wri_doc_page_width_r(wri_doc_t *doc, int width);
+extern int wri_doc_page_height_r(wri_doc_t *doc, int height);
+extern int wri_doc_distance_from_top_r(wri_doc_t *doc, int distance);
+extern int wri_doc_distance_from_bottom_r(wri_doc_t *doc, int distance);
 
 /* In read.c */
 extern int wri_open(char *filename);
 extern int wri_read(char *filename, int what);
+extern int wri_open_mem(const void *buf, size_t len);
+extern int wri_read_mem(const void *buf, size_t len, int what);
+extern int wri_open_r(wri_doc_t *doc, char *filename);
+extern int wri_read_r(wri_doc_t *doc, char *filename, int what);
+extern int wri_open_mem_r(wri_doc_t *doc, const void *buf, size_t len);
+extern int wri_read_mem_r(wri_doc_t *doc, const void *buf, size_t len,
+			  int what);
+
+/* What wri_scan() finds in a Write file.  Measurements are in twips. */
+struct wri_char_info {
+    int bold, italic, underline;
+    int script;		/* WRI_NORMAL, WRI_SUPERSCRIPT or WRI_SUBSCRIPT */
+    int font_size;	/* In points */
+    int font;		/* Number of the font in the file's font table */
+};
+struct wri_para_info {
+    int justify;	/* WRI_LEFT, WRI_CENTER, WRI_RIGHT or WRI_BOTH */
+    int interline;
+    int indent_left, indent_right, indent_first;
+    int header, footer;	/* Is it part of the page header or footer? */
+    int first_page;	/* If so, is that printed on the first page? */
+    int picture;	/* Is its text a picture? */
+};
+struct wri_section_info {
+    int page_width, page_height;
+    int margin_left, margin_right, margin_top, margin_bottom;
+    int distance_from_top, distance_from_bottom;
+    int number_from;
+};
+struct wri_tab {
+    int position;
+    int decimal;
+};
+struct wri_scan_fns {
+    int (*font)(void *ctx, int font, const char *name, int family);
+    int (*section)(void *ctx, const struct wri_section_info *sip);
+    int (*tabs)(void *ctx, int ntabs, const struct wri_tab *tabs);
+    int (*para)(void *ctx, const struct wri_para_info *pip);
+    int (*text)(void *ctx, const char *text, size_t len,
+		const struct wri_char_info *cip);
+};
+extern int wri_scan(char *filename, const struct wri_scan_fns *fns, void *ctx);
+extern int wri_scan_mem(const void *buf, size_t len,
+			const struct wri_scan_fns *fns, void *ctx);
+
+/* In splice.c */
+extern int wri_splice(wri_doc_t *frag);
+extern int wri_splice_r(wri_doc_t *doc, wri_doc_t *frag);
+
+/* In template.c */
+typedef struct wri_template wri_template_t;
+extern wri_template_t *wri_template_load(char *filename);
+extern wri_template_t *wri_template_load_mem(const void *buf, size_t len);
+extern void wri_template_free(wri_template_t *tpl);
+extern int wri_template_insert(const wri_template_t *tpl, int what);
+extern int wri_template_insert_r(wri_doc_t *doc, const wri_template_t *tpl,
+				 int what);
+typedef const char *(*wri_field_fn)(void *ctx, const char *name);
+extern int wri_template_merge(const wri_template_t *tpl, int what,
+			      wri_field_fn field_fn, void *ctx);
+extern int wri_template_merge_r(wri_doc_t *doc, const wri_template_t *tpl,
+				int what, wri_field_fn field_fn, void *ctx);
+extern const char *wri_template_field(const wri_template_t *tpl,
+				      unsigned long n);
 
 /* In save.c */
+typedef int (*wri_write_fn)(void *ctx, const char *buf, size_t len);
 extern int wri_save(char *filename);
+extern int wri_save_mem(void **bufp, size_t *lenp);
+extern int wri_save_sink(wri_write_fn write_fn, void *ctx);
+extern int wri_save_stream(FILE *ofp);
+extern size_t wri_saved_size(void);
+extern int wri_save_begin(char *filename);
+extern int wri_save_begin_sink(wri_write_fn write_fn, void *ctx);
+extern int wri_save_step(unsigned long budget);
+extern int wri_save_end(void);
+extern int wri_begin(char *filename);
+extern int wri_end(void);
+extern int wri_save_r(wri_doc_t *doc, char *filename);
+extern int wri_save_mem_r(wri_doc_t *doc, void **bufp, size_t *lenp);
+extern int wri_save_sink_r(wri_doc_t *doc, wri_write_fn write_fn, void *ctx);
+extern int wri_save_stream_r(wri_doc_t *doc, FILE *ofp);
+extern size_t wri_saved_size_r(wri_doc_t *doc);
+extern int wri_save_begin_r(wri_doc_t *doc, char *filename);
+extern int wri_save_begin_sink_r(wri_doc_t *doc, wri_write_fn write_fn,
+				 void *ctx);
+extern int wri_save_step_r(wri_doc_t *doc, unsigned long budget);
+extern int wri_save_end_r(wri_doc_t *doc);
+extern int wri_begin_r(wri_doc_t *doc, char *filename);
+extern int wri_end_r(wri_doc_t *doc);
 
 /*
  * Definitions for the parameter to _wri_char_script().
@@ -86,6 +228,11 @@ extern int wri_save(char *filename);
 /* Definitions for type of tabstop: WRI_NORMAL and... */
 #define WRI_DECIMAL 3	/* Value in PAP.jcTab for decimal tab stop */
 
+/* Values returned by wri_save_step() */
+#define WRI_SAVE_DONE	0   /* The file has all been written */
+#define WRI_SAVE_ERROR	1   /* Something failed */
+#define WRI_SAVE_MORE	2   /* There is more to write */
+
 /* Definitions for the parameter <what> to _wri_read() */
 #define WRI_TEXT 1
 #define WRI_CHAR_INFO 2
@@ -5,7 +5,8 @@
  */
 
 #include <stdio.h>  /* for NULL */
-#include <malloc.h> /* for malloc() */
+#include <stddef.h> /* for offsetof() */
+#include <stdlib.h> /* for malloc() and realloc() */
 #include <string.h> /* for memcpy() */
 #include <memory.h> /* for memcpy() */
 #include "write.h"
@@ -13,45 +14,212 @@
 #include "defs.h"
 
 /*
- * Allocate a new property structure, adding it to the end of the list.
- * We are passed the address of the pointer to the last item in the list
- * (because we must modify it to point to the new item), and the size of the
- * structure in question.
- * We copy the contents of the old structure into the new.
- *
- * Returns the address of the new element that we add to the end of the list,
- * or NULL if we are out of memory.
+ * The CHPs and PAPs of the document are kept in tables of runs, one column
+ * per field rather than one structure per run, so that a document with
+ * millions of runs takes little memory and the saving code can scan them
+ * in order.  Run i covers the characters from cpLim[i-1] (or 0 for the first
+ * run) up to cpLim[i], and its properties are style[i], an index into a
+ * table of the different properties used in the document.
+ * The tables grow by doubling, so adding to the end takes constant time,
+ * and they can be cut back just by reducing the number of entries.
  */
-struct lprop *
-_wri_new_lprop(struct lprop **lprop_currp, int lprop_size)
+
+/* Make room for one more entry in a table of <size>-byte elements, by
+ * doubling the number of entries in it. */
+static int
+grow(void **tablep, unsigned long *maxp, size_t size)
 {
-    struct lprop *lprop_new;
-    struct lprop *lprop_curr = *lprop_currp;	/* for easy access */
+    unsigned long new_max = (*maxp == 0) ? 64 : *maxp * 2;
+    void *new_table;
+
+    new_table = realloc(*tablep, (size_t) new_max * size);
+    if (new_table == NULL) return(1);	/* Fatal error for the caller */
+    *tablep = new_table;
+    *maxp = new_max;
+
+    return(0);
+}
 
-    lprop_new = (struct lprop *) malloc(lprop_size);
-    if (lprop_new == NULL) {
-	_wri_error = 1;	/* Fatal error */
-	return(NULL);
+/* Add a run to the end of a table of runs */
+int
+_wri_add_run(struct runs *rp, CP cpLim, unsigned style)
+{
+    if (rp->n == rp->max) {
+	unsigned long max = rp->max;
+
+	if (grow((void **) &(rp->cpLim), &max, sizeof(CP)) ||
+	    grow((void **) &(rp->style), &(rp->max), sizeof(unsigned))) {
+	    return(1);
+	}
     }
+    rp->cpLim[rp->n] = cpLim;
+    rp->style[rp->n] = style;
+    rp->n++;
+
+    return(0);
+}
 
-    /* Copy info from old into new element */
-    memcpy(lprop_new, lprop_curr, lprop_size);
+void
+_wri_free_runs(struct runs *rp)
+{
+    if (rp->cpLim != NULL) free((char *) rp->cpLim);
+    if (rp->style != NULL) free((char *) rp->style);
+    rp->cpLim = NULL;
+    rp->style = NULL;
+    rp->n = rp->max = 0;
+}
 
-    /*
-     * The new CHP starts where the previous one finished, and finishes
-     * there too as it doesn't refer to any characters yet.
-     */
-    lprop_new->cpFirst = lprop_curr->cpLim;
-    /* lprop_new->cpLim = lprop_curr->cpLim already from memcpy */
+/*
+ * The different CHPs or PAPs used in the document are each stored once in a
+ * table of styles, identified by a key made by packing their fields into
+ * integers.  A hash table of their indices, with linear probing, finds the
+ * index of an existing style from its key.  It is kept at most half full.
+ */
+
+/* Which slot of the hash table does a key hash to? */
+static unsigned long
+hash_key(struct styles *sp, struct style_key key)
+{
+    unsigned long long h;
+
+    h = (key.lo ^ (key.hi * 0xC2B2AE3D27D4EB4FULL)) * 0x9E3779B97F4A7C15ULL;
+
+    return((unsigned long) (h >> 32) & (sp->hash_size - 1));
+}
+
+/* Put the first n styles of the table into a hash table of <size> slots */
+static int
+rehash(struct styles *sp, unsigned long size)
+{
+    unsigned long i;
+
+    if (size != sp->hash_size) {
+	unsigned *new_hash = (unsigned *) malloc((size_t) size * sizeof(unsigned));
+
+	if (new_hash == NULL) return(1);	/* Fatal error for the caller */
+	if (sp->hash != NULL) free((char *) sp->hash);
+	sp->hash = new_hash;
+	sp->hash_size = size;
+    }
+
+    for (i = 0; i < size; i++) sp->hash[i] = NO_STYLE;
+
+    for (i = 0; i < sp->n; i++) {
+	unsigned long h = hash_key(sp, sp->key[i]);
+
+	while (sp->hash[h] != NO_STYLE) h = (h + 1) & (size - 1);
+	sp->hash[h] = (unsigned) i;
+    }
+
+    return(0);
+}
+
+/*
+ * Return the index of the style with the given key, adding it to the table
+ * if it is not already there.	Returns NO_STYLE if we are out of memory.
+ */
+unsigned
+_wri_intern_style(struct styles *sp, struct style_key key)
+{
+    unsigned long h;
+
+    if (sp->hash_size == 0 && rehash(sp, 64)) return(NO_STYLE);
+
+    /* Look for it */
+    for (h = hash_key(sp, key); sp->hash[h] != NO_STYLE;
+	 h = (h + 1) & (sp->hash_size - 1)) {
+	if (SAME_KEY(sp->key[sp->hash[h]], key)) return(sp->hash[h]);
+    }
+
+    /* Not there: add it */
+    if (sp->n == sp->max) {
+	if (grow((void **) &(sp->key), &(sp->max), sizeof(struct style_key))) {
+	    return(NO_STYLE);
+	}
+    }
+    sp->key[sp->n] = key;
+    sp->hash[h] = (unsigned) sp->n;
+    sp->n++;
+
+    /* Keep the hash table no more than half full */
+    if (sp->n * 2 > sp->hash_size && rehash(sp, sp->hash_size * 2)) {
+	return(NO_STYLE);
+    }
+
+    return((unsigned) sp->n - 1);
+}
 
-    /* Add it to end of the list and advance lchp_curr to point to it. */
-    lprop_new->next = NULL;
-    lprop_curr->next = lprop_new;
-    lprop_curr = lprop_new;
+/*
+ * Return the index of the style with the given key, or NO_STYLE if it is not
+ * in the table.  Unlike _wri_intern_style(), this leaves the table alone.
+ */
+unsigned
+_wri_find_style(struct styles *sp, struct style_key key)
+{
+    unsigned long h;
 
-    *lprop_currp = lprop_curr;
+    if (sp->hash_size == 0) return(NO_STYLE);
 
-    return(lprop_curr);
+    for (h = hash_key(sp, key); sp->hash[h] != NO_STYLE;
+	 h = (h + 1) & (sp->hash_size - 1)) {
+	if (SAME_KEY(sp->key[sp->hash[h]], key)) return(sp->hash[h]);
+    }
+
+    return(NO_STYLE);
+}
+
+/* Forget all but the first n styles in the table */
+int
+_wri_cut_styles(struct styles *sp, unsigned long n)
+{
+    if (n == sp->n) return(0);
+
+    sp->n = n;
+    if (sp->nfprops > n) sp->nfprops = n;
+
+    return(sp->hash_size == 0 ? 0 : rehash(sp, sp->hash_size));
+}
+
+/*
+ * Return a table with one entry per style in the table, all NO_STYLE, for
+ * translating the styles into those of another table.  NULL if we are out
+ * of memory.  The caller frees it.
+ */
+unsigned *
+_wri_new_style_map(struct styles *sp)
+{
+    unsigned *map;
+    unsigned long i;
+
+    map = (unsigned *) malloc((size_t) (sp->n + 1) * sizeof(unsigned));
+    if (map == NULL) return(NULL);
+
+    for (i = 0; i < sp->n; i++) map[i] = NO_STYLE;
+
+    return(map);
+}
+
+void
+_wri_free_styles(struct styles *sp)
+{
+    if (sp->key != NULL) free((char *) sp->key);
+    if (sp->hash != NULL) free((char *) sp->hash);
+    if (sp->fprop != NULL) free(sp->fprop);
+    sp->key = NULL;
+    sp->hash = NULL;
+    sp->fprop = NULL;
+    sp->n = sp->max = sp->hash_size = 0;
+    sp->nfprops = sp->maxfprops = 0;
+}
+
+/*
+ * Forget the FPROPs encoded for the styles, when something that they depend
+ * on, apart from the styles themselves, has changed.
+ */
+void
+_wri_forget_fprops(struct styles *sp)
+{
+    sp->nfprops = 0;
 }
 
 /*
@@ -79,3 +247,244 @@ _wri_find_cch(char *cp1, char *cp2, int max_chars)
 
     return(cch);
 }
+
+/*
+ * Pack runs of CHPs or PAPs into FKP pages.
+ *
+ * Each run needs a FOD in its page and, unless its properties are the
+ * default ones or another run in the page has the same style, an FPROP of
+ * cch bytes prefixed by cch.  Runs with the same style have the same
+ * properties, so each style's FPROP is encoded just once, and kept in the
+ * table of styles for the next time.  Then:
+ * - _wri_plan_fkp() assigns the runs to pages, knowing only how much room
+ *   each one takes.  This must be done in order, as whether a run fits in a
+ *   page depends on all those before it, but is just a sum.  It tells
+ *   save.c how many pages there will be before any of them are made;
+ * - _wri_fill_fkp() fills in the pages, in several threads at once, as
+ *   each page is now independent of the others.
+ */
+
+#define SKIP_RUN 0xFF	/* cch of a run that is left out */
+#define FKP_ROOM (offsetof(struct FKP, cfod) - offsetof(struct FKP, rgFPROP))
+
+/* Accessors for the runs of a source, including the one after the table */
+#define FKP_CPLIM(fsp, i) \
+	((i) < (fsp)->runs->n ? (fsp)->runs->cpLim[i] : (fsp)->cpLim)
+#define FKP_CPFIRST(fsp, i) ((i) == 0 ? (CP) 0 : FKP_CPLIM(fsp, (i) - 1))
+#define FKP_STYLE(fsp, i) \
+	((i) < (fsp)->runs->n ? (fsp)->runs->style[i] : (fsp)->style)
+
+/* The pages to fill in, for fill_pages() */
+struct fkp_job {
+    struct fkp_plan *pp;
+    char *pages;
+};
+
+/* The FPROP of a style */
+#define FKP_FPROP(pp, style) ((style) < (pp)->src.styles->n ? \
+	(pp)->src.styles->fprop + (size_t) (style) * FPROP_MAX : (pp)->extra)
+
+/* Encode the FPROP of a style into fprop[] */
+static void
+encode_fprop(struct fkp_source *fsp, unsigned style, char *fprop)
+{
+    union {
+	struct CHP chp;
+	struct PAP pap;
+    } props;	/* Big enough for the properties of any run */
+    int cch;
+
+    (*fsp->props)(fsp, style, (char *) &props);
+    cch = _wri_find_cch((char *) &props, fsp->deflt, fsp->size);
+    fprop[0] = (char) cch;
+    memcpy(fprop + 1, (char *) &props, (size_t) cch);
+}
+
+/* Encode the FPROPs of the styles that don't have one yet */
+static int
+encode_styles(struct fkp_plan *pp)
+{
+    struct fkp_source *fsp = &pp->src;
+    struct styles *sp = fsp->styles;
+
+    if (sp->n > sp->maxfprops) {
+	char *new_fprop;
+
+	new_fprop = realloc(sp->fprop, (size_t) sp->max * FPROP_MAX);
+	if (new_fprop == NULL) return(1);
+	sp->fprop = new_fprop;
+	sp->maxfprops = sp->max;
+    }
+    for (; sp->nfprops < sp->n; sp->nfprops++) {
+	encode_fprop(fsp, (unsigned) sp->nfprops,
+		     sp->fprop + (size_t) sp->nfprops * FPROP_MAX);
+    }
+    if (fsp->style == sp->n) encode_fprop(fsp, fsp->style, pp->extra);
+
+    return(0);
+}
+
+/* Assign the runs to pages.  Returns the number of pages. */
+static unsigned long
+assign_pages(struct fkp_plan *pp, unsigned long *in_page)
+{
+    struct fkp_source *fsp = &pp->src;
+    unsigned long npages = 0;	/* Pages started so far */
+    unsigned space_left = 0;	/* Room left in the current page */
+    unsigned long i;
+
+    for (i = 0; i < fsp->n; i++) {
+	unsigned style = FKP_STYLE(fsp, i);
+	int cch = *FKP_FPROP(pp, style);
+	unsigned total_size;	/* Space needed to specify this run */
+	int new_fprop = 0;	/* Does it need an FPROP of its own? */
+
+	/* Don't bother saving runs that don't refer to anything */
+	if (fsp->skip_empty && FKP_CPFIRST(fsp, i) == FKP_CPLIM(fsp, i)) {
+	    continue;
+	}
+
+	/* in_page[style] is one more than the page with that style in it */
+	if (cch <= 1 ||
+	    (space_left >= sizeof(struct FOD) && in_page[style] == npages)) {
+	    total_size = sizeof(struct FOD);
+	} else {
+	    total_size = sizeof(struct FOD) + cch + 1;
+	    new_fprop = 1;
+	}
+
+	/* If it doesn't fit, start a new page */
+	if (npages == 0 || total_size > space_left) {
+	    pp->first[npages++] = i;
+	    space_left = FKP_ROOM;
+	}
+
+	if (new_fprop) in_page[style] = npages;
+	space_left -= total_size;
+    }
+    pp->first[npages] = fsp->n;
+
+    return(npages);
+}
+
+/* Fill in some of the pages */
+static void
+fill_pages(void *arg, unsigned long from, unsigned long to)
+{
+    struct fkp_job *jp = (struct fkp_job *) arg;
+    struct fkp_plan *pp = jp->pp;
+    struct fkp_source *fsp = &pp->src;
+    unsigned long pn;
+
+    for (pn = from; pn < to; pn++) {
+	struct FKP *fkpp = (struct FKP *) (jp->pages + pn * PAGESIZE);
+	char *start_of_props = (char *) &(fkpp->cfod);
+	unsigned fprop_style[FKP_ROOM / 3];	/* FPROPs in the page so far */
+	int fprop_bfprop[FKP_ROOM / 3];
+	int nfprops = 0;
+	unsigned long i;
+
+	fkpp->fcFirst = FKP_CPFIRST(fsp, pp->first[pn]) + PAGESIZE;
+	fkpp->cfod = 0;
+
+	for (i = pp->first[pn]; i < pp->first[pn + 1]; i++) {
+	    unsigned style = FKP_STYLE(fsp, i);
+	    char *fprop = FKP_FPROP(pp, style);
+	    struct FOD *fodp;	/* pointer to current FOD for convenience */
+	    int bfprop;		/* bfprop for FOD */
+
+	    if (fsp->skip_empty && FKP_CPFIRST(fsp, i) == FKP_CPLIM(fsp, i)) {
+		continue;
+	    }
+
+	    if (*fprop <= 1) {
+		/* default properties: just the FOD */
+		bfprop = 0xFFFF;
+	    } else {
+		int k;
+
+		for (k = 0; k < nfprops && fprop_style[k] != style; k++) ;
+
+		if (k < nfprops) {
+		    /* The same properties are already in the page */
+		    bfprop = fprop_bfprop[k];
+		} else {
+		    /* Copy in the FPROP, cch and all */
+		    start_of_props -= 1 + *fprop;
+		    memcpy(start_of_props, fprop, (size_t) (1 + *fprop));
+
+		    /* bfprop is the offset of FPROP from start of FOD array */
+		    bfprop = start_of_props - fkpp->rgFPROP;
+
+		    fprop_style[nfprops] = style;
+		    fprop_bfprop[nfprops] = bfprop;
+		    nfprops++;
+		}
+	    }
+
+	    fodp = &(fkpp->rgFOD[fkpp->cfod]);
+	    fodp->bfprop = bfprop;
+
+	    /* set fcLim, converting from index-into-text to index-into-file */
+	    fodp->fcLim = FKP_CPLIM(fsp, i) + PAGESIZE;
+
+	    fkpp->cfod++;
+	}
+    }
+}
+
+/*
+ * Work out which runs of pp->src go in which page.  The caller frees the plan
+ * with _wri_free_fkp() whether this succeeds or not.
+ */
+int
+_wri_plan_fkp(struct fkp_plan *pp)
+{
+    struct fkp_source *fsp = &pp->src;
+    unsigned long *in_page;	/* For each style, see assign_pages() */
+
+    pp->npages = 0;
+    pp->first = (unsigned long *) malloc((size_t) (fsp->n + 1) *
+					 sizeof(unsigned long));
+    in_page = (unsigned long *) calloc((size_t) fsp->styles->n + 1,
+				       sizeof(unsigned long));
+    if (pp->first == NULL || in_page == NULL || encode_styles(pp)) {
+	if (in_page != NULL) free((char *) in_page);
+	return(1);
+    }
+
+    pp->npages = assign_pages(pp, in_page);
+
+    free((char *) in_page);
+    return(0);
+}
+
+/* Fill in the pp->npages pages at <pages>, which are all zeroes */
+void
+_wri_fill_fkp(struct fkp_plan *pp, char *pages)
+{
+    struct fkp_job job;
+
+    job.pp = pp;
+    job.pages = pages;
+    _wri_parallel(pp->npages, fill_pages, (void *) &job);
+}
+
+/* Fill in just the pages from <from> to <to> of those at <pages> */
+void
+_wri_fill_fkp_pages(struct fkp_plan *pp, char *pages,
+		    unsigned long from, unsigned long to)
+{
+    struct fkp_job job;
+
+    job.pp = pp;
+    job.pages = pages;
+    fill_pages((void *) &job, from, to);
+}
+
+void
+_wri_free_fkp(struct fkp_plan *pp)
+{
+    if (pp->first != NULL) free((char *) pp->first);
+    pp->first = NULL;
+}
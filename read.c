@@ -10,38 +10,102 @@
  *  Copyright 1992 Martin Guy, Via Marzabotto 3, 47036 Riccione - FO, Italy.
  */
 #include <stdio.h>  /* for NULL */
+#include <stdlib.h> /* for malloc() */
 #include <string.h> /* for strlen() */
+#ifndef _WINDOWS
+# include <sys/types.h>
+# include <sys/mman.h>	/* for mmap() */
+# include <sys/stat.h>	/* for fstat() */
+# include <unistd.h>	/* for pread() */
+#endif
 #include "libwrite.h"	/* Public definitions */
 #include "write.h"	/* Data structures for Write documents */
 #include "defs.h"	/* Definitions internal to the library */
 
+/*
+ * The Write file being read.  We have it all in memory where we can, so
+ * that its pages can be decoded where they are and its text copied straight
+ * out of it: a big file is mapped, while a small one, for which that costs
+ * more than it saves, is read in one go.  Otherwise we read it a page at a
+ * time.  For wri_read_mem() it is the caller's buffer, and there is no file.
+ */
+struct in_file {
+    FILE *fp;	    /* The file, or NULL */
+    char *map;	    /* The whole file, if it is in memory, or NULL */
+    FC size;	    /* and its length */
+    int mapped;	    /* Is map[] mapped, rather than allocated? */
+};
+
+#define MAP_MIN 65536L	/* Smallest file worth mapping */
+
+/* Private data, for the duration of one wri_read() */
+struct read_state {
+    FC fcStart;	    /* Index into file of first character to copy */
+    FC fcEnd;	    /* One past the last character */
+    FC initial_text;	/* Amount of text there was already in the temp file */
+
+    /* Table to convert font codes from file into our font codes */
+    int font_map[MAX_FONTS];
+    int nfonts;	    /* How many of them the file's font table defined */
+};
+
+/*
+ * Where the scan of a table of CHPs or PAPs has got to: the page being
+ * decoded and the end of the table, and the next FOD of the page.
+ */
+struct fkp_cursor {
+    PN pn, pnLim;	/* Next page of the table, and the one after it */
+    struct FKP page;	/* Room for the page if the file isn't in memory */
+    struct FKP *fkpp;	/* The page, or NULL before the first one */
+    int i;		/* Next FOD in it */
+    FC fcLim;		/* End of the text of the last FOD */
+};
+
+/* What get_fonts() needs to add a file's fonts to a document */
+struct font_map_arg {
+    wri_doc_t *doc;
+    struct read_state *rs;
+};
+
 /*
  *  Function prototypes
  */
-static int read_page(PN n, int extent, char *buf, FILE *ifp);
-static int read_header(FILE *ifp, struct wri_header *hp);
-static int read_text(FILE *ifp, struct wri_header *hp);
-static int read_chps(FILE *ifp, struct wri_header *hp);
-static int read_paps(FILE *ifp, struct wri_header *hp,
-    int want_paps, int want_tabs);
-static int read_section(FILE *ifp, struct wri_header *hp);
-static int read_fonts(FILE *ifp, struct wri_header *hp);
-
-/* Private data */
-static FC fcStart;  /* Index into file of first character to copy */
-static FC fcEnd;    /* One past the last character */
-static FC initial_text; /* Amount of text there was already in the temp file */
-
-/* Table to convert font codes from file into our font codes */
-static int font_map[MAX_FONTS];
+static int read_file(wri_doc_t *doc, struct in_file *ip, int what);
+static int scan_file(struct in_file *ip, const struct wri_scan_fns *fns,
+    void *ctx);
+static int open_in(struct in_file *ip, char *filename);
+static void close_in(struct in_file *ip);
+static char *read_at(struct in_file *ip, FC offset, size_t len, char *buf);
+static char *read_page(struct in_file *ip, PN n, int extent, char *buf);
+static int copy_page(struct in_file *ip, PN n, int extent, char *buf);
+static int read_header(struct in_file *ip, struct wri_header *hp);
+static int next_fod(struct in_file *ip, struct fkp_cursor *cp);
+static void get_prop(struct FKP *fkpp, int i, char *prop, const char *deflt,
+    size_t size);
+static void get_chp(struct FKP *fkpp, int i, struct CHP *chpp);
+static void get_pap(struct FKP *fkpp, int i, struct PAP *papp);
+static int get_sep(struct in_file *ip, struct wri_header *hp,
+    struct SEP *sepp);
+static int get_fonts(struct in_file *ip, struct wri_header *hp,
+    int (*fn)(void *arg, int ftc, const char *name, int ffid), void *arg);
+static int map_font(void *arg, int ftc, const char *name, int ffid);
+static int read_text(wri_doc_t *doc, struct read_state *rs,
+    struct in_file *ip, struct wri_header *hp);
+static int read_chps(wri_doc_t *doc, struct read_state *rs,
+    struct in_file *ip, struct wri_header *hp);
+static int read_paps(wri_doc_t *doc, struct read_state *rs,
+    struct in_file *ip, struct wri_header *hp, int want_paps, int want_tabs);
+static int read_section(wri_doc_t *doc, struct in_file *ip, struct wri_header *hp);
+static int read_fonts(wri_doc_t *doc, struct read_state *rs,
+    struct in_file *ip, struct wri_header *hp);
 
 /*
  *  User functions
  */
 int
-wri_open(char *filename)
+wri_open_r(wri_doc_t *doc, char *filename)
 {
-    return(wri_new() || wri_read(filename, WRI_ALL));
+    return(wri_new_r(doc) || wri_read_r(doc, filename, WRI_ALL));
 }
 
 /*
@@ -67,41 +131,107 @@ wri_open(char *filename)
  *  character in the document.
  */
 int
-wri_read(char *filename, int what)
+wri_read_r(wri_doc_t *doc, char *filename, int what)
 {
-    FILE *ifp;	/* file pointer open to Write file */
-    struct wri_header header;	/* header from Write file */
+    struct in_file in;	/* The Write file */
+    int failed;
 
-    ifp = fopen(filename, "rb");
-    if (ifp == NULL) {
-	return(1);
-    }
+    if (open_in(&in, filename)) return(1);
+    failed = read_file(doc, &in, what);
+    close_in(&in);
 
-    if (read_header(ifp, &header)) return(1);
+    return(failed);
+}
 
-    /* Check obligatory values. We don't cope with files containg OLE objects */
-    if (header.wIdent != WRIH_WIDENT ||
-	header.wTool != WRIH_WTOOL) {
-	    /* Not a Write file */
-	    goto fail;
-    }
+/*
+ *  The same, reading a Write file that the caller has in memory.
+ */
+int
+wri_read_mem_r(wri_doc_t *doc, const void *buf, size_t len, int what)
+{
+    struct in_file in;	/* The Write file */
 
-    if (header.pnMac == 0) {
-	/* It's a Word file, not a Write file */
-	goto fail;
-    }
+    if (buf == NULL) return(1);
+
+    in.fp = NULL;
+    in.map = (char *) buf;	/* We only read it */
+    in.size = (FC) len;
+    in.mapped = 0;
+
+    return(read_file(doc, &in, what));
+}
+
+int
+wri_open_mem_r(wri_doc_t *doc, const void *buf, size_t len)
+{
+    return(wri_new_r(doc) || wri_read_mem_r(doc, buf, len, WRI_ALL));
+}
+
+/*
+ *  Go through a Write file without adding it to any document, calling the
+ *  functions in <fns> for what is in it, in this order:
+ *  font	for each font in the font table
+ *  section	with the section info (page size and margins)
+ *  tabs	with the tab stops
+ *  para	at the start of each paragraph, including headers and footers
+ *  text	for each run of text with the same character properties,
+ *		maybe in several pieces, after the para of its paragraph.
+ *  Any of them can be NULL.  If one returns non-zero, the scan stops there.
+ *  Only a page of CHPs and one of PAPs are decoded at a time, so any size of
+ *  file can be scanned in the same space.
+ */
+int
+wri_scan(char *filename, const struct wri_scan_fns *fns, void *ctx)
+{
+    struct in_file in;	/* The Write file */
+    int failed;
+
+    if (open_in(&in, filename)) return(1);
+    failed = scan_file(&in, fns, ctx);
+    close_in(&in);
+
+    return(failed);
+}
+
+/* The same, for a Write file in memory */
+int
+wri_scan_mem(const void *buf, size_t len, const struct wri_scan_fns *fns,
+	     void *ctx)
+{
+    struct in_file in;	/* The Write file */
+
+    if (buf == NULL) return(1);
+
+    in.fp = NULL;
+    in.map = (char *) buf;	/* We only read it */
+    in.size = (FC) len;
+    in.mapped = 0;
+
+    return(scan_file(&in, fns, ctx));
+}
+
+static int
+read_file(wri_doc_t *doc, struct in_file *ip, int what)
+{
+    struct wri_header header;	/* header from Write file */
+    struct read_state state, *rs = &state;
+
+    if (read_header(ip, &header)) return(1);
 
     /* Remember start and one-past-the-end of the text to copy (fcStart will
      * be incremented if there are initial header/footer paragraphs)
      */
-    fcStart = PAGESIZE;
-    fcEnd = header.fcMac;
+    rs->fcStart = PAGESIZE;
+    rs->fcEnd = header.fcMac;
 
     /*
      * Remember number of bytes of text already output, the amount by
      * which character indices in CHPs and PAPs will be offset.
      */
-    initial_text = _wri_cpMac;	/* From text.c */
+    rs->initial_text = doc->text.cpMac;	/* From text.c */
+
+    /* No fonts yet, until read_fonts() finds some */
+    rs->nfonts = 0;
 
     /*
      * Append CHPs to the list of CHPs, PAPs to the list of PAPs and
@@ -120,7 +250,7 @@ wri_read(char *filename, int what)
      */
 
     /* Read the font info */
-    if ((what & WRI_CHAR_INFO) && read_fonts(ifp, &header)) {
+    if ((what & WRI_CHAR_INFO) && read_fonts(doc, rs, ip, &header)) {
 	/* We don't need to forget the new fonts - they don't do any harm */
 	goto fail;
     }
@@ -132,30 +262,30 @@ wri_read(char *filename, int what)
      * to set fcStart so that read_text() and read_chps() know how much text
      * to treat.
      */
-    _wri_breakpoint_pap();
-    _wri_breakpoint_text();	/* breakpoint text even if we don't read it */
-    _wri_breakpoint_chp();
+    _wri_breakpoint_pap(doc);
+    _wri_breakpoint_text(doc);	/* breakpoint text even if we don't read it */
+    _wri_breakpoint_chp(doc);
 
     if ((what & WRI_TEXT) || (what & WRI_PARA_INFO) ) {
 	/* Read PAPs, and maybe tab info */
-	if (read_paps(ifp, &header, 1, what & WRI_TABS)) {
+	if (read_paps(doc, rs, ip, &header, 1, what & WRI_TABS)) {
 	    goto rollback;
 	}
 
 	if (what & WRI_TEXT)
-	    if (read_text(ifp, &header)) {
+	    if (read_text(doc, rs, ip, &header)) {
 		goto rollback;
 	    }
 
 	/* Text with char info: read CHPs. */
 	if (what & WRI_CHAR_INFO) {
-	    if (read_chps(ifp, &header)) {
+	    if (read_chps(doc, rs, ip, &header)) {
 		goto rollback;
 	    }
 	} else {
 	    /* Text without char info: extend the current CHP to cover the new
 	     * text */
-	    _wri_extend_chp(fcEnd - fcStart + initial_text);
+	    _wri_extend_chp(doc, rs->fcEnd - rs->fcStart + rs->initial_text);
 	}
 
 	/* If the document ended with a paragraph break, we must create a new
@@ -163,14 +293,14 @@ wri_read(char *filename, int what)
 	 * the last paragraph in the document).	 If this results in a bogus
 	 * empty paragraph, no problem because this is checked for in the
 	 * saving code.
-	 * read_text() has side-effected _wri_last_char_read to the value of the
+	 * read_text() has side-effected text.last_char_read to the value of the
 	 * final character in the Write file.  If it was \n or \f, it ended with
 	 * a paragraph break.
 	 */
-	switch (_wri_last_char_read) {
+	switch (doc->text.last_char_read) {
 	case '\n':
 	case '\f':
-	    _wri_new_paragraph();
+	    _wri_new_paragraph(doc);
 	    break;
 	}
     } else {
@@ -178,116 +308,124 @@ wri_read(char *filename, int what)
 	 * tab settings, we must read a PAP to get them */
 	if (what & WRI_TABS) {
 	    /* Read tab settings without reading PAPs. */
-	    if (read_paps(ifp, &header, 0, 1)) goto rollback;
+	    if (read_paps(doc, rs, ip, &header, 0, 1)) goto rollback;
 	}
     }
 
     /* Read section info if required */
-    if ((what & WRI_DOCUMENT) && read_section(ifp, &header)) {
+    if ((what & WRI_DOCUMENT) && read_section(doc, ip, &header)) {
 	/* If read_section fails, it doesn't modify the section info, but we
 	 * do want to undo the rest of the stuff. */
 	goto rollback;
     }
 
-    (void) fclose(ifp);
     return(0);
 
     /* Failure after breakpointing: roll everything back to where it was. */
 rollback:
-    _wri_rollback_text();
-    _wri_rollback_chp();
-    _wri_rollback_pap();
+    _wri_rollback_text(doc);
+    _wri_rollback_chp(doc);
+    _wri_rollback_pap(doc);
 
 fail:
-    (void) fclose(ifp);
     return(1);
 }
 
+/*
+ * Read the header and check its obligatory values.  We don't cope with files
+ * containing OLE objects.
+ */
 static int
-read_header(FILE *ifp, struct wri_header *hp)
+read_header(struct in_file *ip, struct wri_header *hp)
 {
-    return(read_page((PN)0, sizeof(*hp), (char *)hp, ifp));
+    if (copy_page(ip, (PN)0, sizeof(*hp), (char *)hp)) return(1);
+
+    if (hp->wIdent != WRIH_WIDENT ||
+	hp->wTool != WRIH_WTOOL) {
+	    /* Not a Write file */
+	    return(1);
+    }
+
+    if (hp->pnMac == 0) {
+	/* It's a Word file, not a Write file */
+	return(1);
+    }
+
+    return(0);
 }
 
 /* Copy the relevant text into the temp file.
  * Its CHPs and PAPs are already present.
  */
 static int
-read_text(FILE *ifp, struct wri_header *hp)
+read_text(wri_doc_t *doc, struct read_state *rs,
+	  struct in_file *ip, struct wri_header *hp)
 {
-    if (fseek(ifp, fcStart, SEEK_SET) != 0) return(1);
-    if (_wri_append_text(ifp, fcEnd - fcStart)) return(1);
+    if (rs->fcEnd < rs->fcStart) return(1);
+
+    if (ip->map != NULL) {
+	if (rs->fcEnd > ip->size) return(1);
+	return(_wri_append_text_mem(doc, ip->map + rs->fcStart,
+				    rs->fcEnd - rs->fcStart));
+    }
+
+    if (fseek(ip->fp, rs->fcStart, SEEK_SET) != 0) return(1);
+    if (_wri_append_text(doc, ip->fp, rs->fcEnd - rs->fcStart)) return(1);
     return(0);
 }
 
 static int
-read_chps(FILE *ifp, struct wri_header *hp)
+read_chps(wri_doc_t *doc, struct read_state *rs,
+	  struct in_file *ip, struct wri_header *hp)
 {
-    PN pn;  /* page number of page of CHPs that we are reading */
-    CP fcFirst, fcLim;	/* Start and end of text for current CHP,
-			 * as offsets in the Write file */
-
-    /* For each page of CHP info... */
-    for (pn = pnChar(*hp); pn < hp->pnPara; pn++) {
-	struct FKP fkp; /* page of CHP info being decoded... */
-	int i;
-
-	/* ...read it into our buffer... */
-	if (read_page(pn, PAGESIZE, (char *)&fkp, ifp)) return(1);
-
-	fcFirst = fkp.fcFirst;
-	for (i=0; i < (int)fkp.cfod; i++) {
-	    struct CHP chp;
-	    int bfprop;
-
-	    fcLim = fkp.rgFOD[i].fcLim;
-	    bfprop = fkp.rgFOD[i].bfprop;
+    struct fkp_cursor chps;	/* Where we are in the pages of CHP info */
+    CP fcLim;	/* End of text for current CHP, as an offset in the Write file */
+    int end;	/* Did next_fod() fail or run out? */
+
+    chps.pn = pnChar(*hp);
+    chps.pnLim = hp->pnPara;
+    chps.fkpp = NULL;
+    fcLim = PAGESIZE;
+
+    /* For each CHP... */
+    while ((end = next_fod(ip, &chps)) == 0) {
+	struct CHP chp;
+
+	fcLim = chps.fcLim;
+
+	/* Check that the CHP refers to a part of the text that we are
+	 * going to copy (ie not to initial running head code paragraphs).
+	 * One that spans the initial rhc paragraphs and the first textual
+	 * paragraph needs no special treatment, because we don't use where
+	 * it starts.
+	 */
+	if (fcLim > rs->fcStart) {
+	    get_chp(chps.fkpp, chps.i - 1, &chp);
 
-	    /* Check that the CHP refers to a part of the text that we are
-	     * going to copy (ie not to initial running head code paragraphs)
+	    /* Map font code.  A file with no font table gets the default
+	     * font; one with a table may only use the fonts in it.
 	     */
-	    if (fcLim > fcStart) {
-		/* Allow for the possibility that a CHP spans the initial
-		 * rhc paragraphs and the first textual paragraph.  In fact,
-		 * this is unnecessary because we don't use fcFirst.
-		 * if (fcFirst < fcStart) {
-		 *     fcFirst = fcStart;
-		 * }
-		 */
-		memcpy(&chp, &_wri_default_chp, sizeof(chp));
-		if (bfprop == -1) {
-		    /* Default CHP */
-		} else {
-		    struct FPROP *fpropp;
-
-		    fpropp = (struct FPROP *) &(fkp.rgFPROP[bfprop]);
-		    /* Copy in the part that differs from the default CHP */
-		    memcpy(&chp, &(fpropp->chp), fpropp->cch);
-		}
-		/* Map font code */
-		chp.ftc = font_map[chp.ftc];
-
-		/* Set ignored byte to the same as the default so that the
-		 * comparison with the default CHP works. */
-		chp.res1 = _wri_default_chp.res1;
-		chp.res2 = _wri_default_chp.res2;
-
-		_wri_append_chp(&chp, initial_text + fcLim - fcStart);
+	    if (rs->nfonts == 0) {
+		chp.ftc = 0;
+	    } else if (chp.ftc >= rs->nfonts) {
+		return(1);
+	    } else {
+		chp.ftc = rs->font_map[chp.ftc];
 	    }
 
-	    /* The next one starts where this one leaves off */
-	    fcFirst = fcLim;
+	    _wri_append_chp(doc, &chp, rs->initial_text + fcLim - rs->fcStart);
 	}
     }
+    if (end > 0) return(1);
 
     /* Check that the coverage of the CHPs is right */
-    if (fcLim != fcEnd) {     
+    if (fcLim != rs->fcEnd) {     
 #ifdef _WINDOWS
 	char szmess[80];
-	wsprintf(szmess, "read_chps: fcLim=%ld should be fcEnd=%ld.", fcLim, fcEnd);
+	wsprintf(szmess, "read_chps: fcLim=%ld should be fcEnd=%ld.", fcLim, rs->fcEnd);
 	MessageBox( 0, szmess, "WriteKit in error", MB_OK|MB_ICONSTOP );
 #else
-	fprintf(stderr, "read_chps: fcLim=%ld should be fcEnd=%ld.\n", fcLim, fcEnd);
+	fprintf(stderr, "read_chps: fcLim=%ld should be fcEnd=%ld.\n", fcLim, rs->fcEnd);
 #endif	    
 	return(1);
     }
@@ -307,9 +445,13 @@ read_chps(FILE *ifp, struct wri_header *hp)
  * they calling us?!)
  */
 static int
-read_paps(FILE *ifp, struct wri_header *hp, int want_paps, int want_tabs)
+read_paps(wri_doc_t *doc, struct read_state *rs,
+	  struct in_file *ip, struct wri_header *hp, int want_paps, int want_tabs)
 {
-    PN pn;  /* page number of page of PAPs that we are reading */
+    struct fkp_cursor paps;	/* Where we are in the pages of PAP info */
+    CP fcFirst, fcLim;	/* Start and end of text for current PAP,
+			 * as offsets in the Write file */
+    int end;	/* Did next_fod() fail or run out? */
     /*
      * While we are reading header and footer paragraphs, ignoring_rhc
      * remains == 1, and when we find the first paragraph of the text, we set
@@ -325,112 +467,93 @@ read_paps(FILE *ifp, struct wri_header *hp, int want_paps, int want_tabs)
     /* If they don't want anything; that's easy! (This cannot happen) */
     if ((!want_paps) & (!want_tabs)) return(0);
 
-    /* For each page of PAP info... */
-    for (pn = hp->pnPara; pn < hp->pnFntb; pn++) {
-	struct FKP fkp; /* page of PAP info being decoded... */
-	CP fcFirst, fcLim;  /* Start and end of text for current PAP,
-			     * as offsets in the Write file */
-	int i;
-
-	/* ...read it into our buffer... */
-	if (read_page(pn, PAGESIZE, (char *)&fkp, ifp)) return(1);
-
-	fcFirst = fkp.fcFirst;
-	fcLimLast = fcFirst;
-	for (i=0; i<(int)fkp.cfod; i++) {
-	    struct PAP pap;	/* Current PAP */
-	    struct FPROP *fpropp;
-	    int bfprop;
-
-	    fcLim = fkp.rgFOD[i].fcLim;
-	    bfprop = fkp.rgFOD[i].bfprop;
-
-	    memcpy(&pap, &_wri_default_pap, sizeof(struct PAP));
-	    if (bfprop == -1) {
-		/* Default PAP */
-	    } else {
-		fpropp = (struct FPROP *) &(fkp.rgFPROP[bfprop]);
-		/* Copy in the part that differs from the default PAP */
-		memcpy(&pap, &(fpropp->pap), fpropp->cch);
-	    }
+    paps.pn = hp->pnPara;
+    paps.pnLim = hp->pnFntb;
+    paps.fkpp = NULL;
+    fcFirst = fcLimLast = PAGESIZE;
 
-	    if (pap.rhcOdd == 0) {
-		/* If this is the first PAP referring to real text, text
-		 * starts here. */
-		if (ignoring_rhc) {
-		    ignoring_rhc = 0;
-		    fcStart = fcFirst;
-		}
-	    }
+    /* For each PAP... */
+    while ((end = next_fod(ip, &paps)) == 0) {
+	struct PAP pap;	/* Current PAP */
 
-	    /* Import tabs from the first PAP if required.  Tab settings are
-	     * included in all PAPs, including those for header/footers.
-	     */
-	    if (want_tabs) {
-		_wri_set_tabs(pap.rgtbd);
-		/* Are the tab settings all they wanted? */
-		if (!want_paps) return(0);
-		want_tabs = 0;	/* Do it just once */
-	    }
+	/* Each page says where its first PAP starts */
+	if (paps.i == 1) {
+	    fcFirst = paps.fkpp->fcFirst;
+	    fcLimLast = fcFirst;
+	}
 
-	    /* All PAPs except initial rhcs get included - even if they are
-	     * bogus RHCs that occur after normal text has been encoutered.
-	     */
-	    if (!ignoring_rhc) {
-		/* Ignore the bogus extra paragraph that extends beyond the end
-		 * of the text */
-		if (fcFirst >= fcEnd) {
-		    /* Bogus PAP */
-		} else {
-		    CP cpLim;
-		    FC real_fcLim;
-
-		    /* The bogus extra paragraph can also be included in
-		     * the last PAP.  Trim the extent if this is the case.
-		     */
-		    real_fcLim = min(fcLim, fcEnd);
-
-		    /* Calculate position of paragraph text in the output file.
-		     * fcLim is file offset of the end of the paragraph in the
-		     * input file,
-		     * fcStart is the file offset of the start of the
-		     * text that we will copy into the output file,
-		     * so (fcLim - fcStart) is the offset of the end of
-		     * the paragraph from the start of the new text.
-		     * initial_text is the amount of text there was already in
-		     * the output file.
-		     */
-		    cpLim = initial_text + real_fcLim - fcStart;
-
-		    /* Set ignored bytes to the same as the default so that the
-		     * comparison with the default CHP works. */
-		    pap.res1 = _wri_default_pap.res1;
-		    pap.res2 = _wri_default_pap.res2;
-		    pap.res3 = _wri_default_pap.res3;
-		    pap.res4 = _wri_default_pap.res4;
-		    pap.res5 = _wri_default_pap.res5;
-
-		    if (_wri_append_pap(&pap, cpLim, is_first_para)) return(1);
-		    is_first_para = 0;
-
-		    /* Remember the end of the last PAP for the final check */
-		    fcLimLast = real_fcLim;
-		}
+	fcLim = paps.fcLim;
+	get_pap(paps.fkpp, paps.i - 1, &pap);
+
+	if (pap.rhcOdd == 0) {
+	    /* If this is the first PAP referring to real text, text
+	     * starts here. */
+	    if (ignoring_rhc) {
+		ignoring_rhc = 0;
+		rs->fcStart = fcFirst;
 	    }
+	}
+
+	/* Import tabs from the first PAP if required.  Tab settings are
+	 * included in all PAPs, including those for header/footers.
+	 */
+	if (want_tabs) {
+	    _wri_set_tabs(doc, pap.rgtbd);
+	    /* Are the tab settings all they wanted? */
+	    if (!want_paps) return(0);
+	    want_tabs = 0;	/* Do it just once */
+	}
+
+	/* All PAPs except initial rhcs get included - even if they are
+	 * bogus RHCs that occur after normal text has been encoutered.
+	 */
+	if (!ignoring_rhc) {
+	    /* Ignore the bogus extra paragraph that extends beyond the end
+	     * of the text */
+	    if (fcFirst >= rs->fcEnd) {
+		/* Bogus PAP */
+	    } else {
+		CP cpLim;
+		FC real_fcLim;
+
+		/* The bogus extra paragraph can also be included in
+		 * the last PAP.  Trim the extent if this is the case.
+		 */
+		real_fcLim = min(fcLim, rs->fcEnd);
+
+		/* Calculate position of paragraph text in the output file.
+		 * fcLim is file offset of the end of the paragraph in the
+		 * input file,
+		 * fcStart is the file offset of the start of the
+		 * text that we will copy into the output file,
+		 * so (fcLim - fcStart) is the offset of the end of
+		 * the paragraph from the start of the new text.
+		 * initial_text is the amount of text there was already in
+		 * the output file.
+		 */
+		cpLim = rs->initial_text + real_fcLim - rs->fcStart;
 
-	    /* The next PAP starts where this one leaves off */
-	    fcFirst = fcLim;
+		if (_wri_append_pap(doc, &pap, cpLim, is_first_para)) return(1);
+		is_first_para = 0;
+
+		/* Remember the end of the last PAP for the final check */
+		fcLimLast = real_fcLim;
+	    }
 	}
+
+	/* The next PAP starts where this one leaves off */
+	fcFirst = fcLim;
     }
+    if (end > 0) return(1);
 
     /* Check that the coverage of the PAPs is right */
-    if (fcLimLast != fcEnd) {
+    if (fcLimLast != rs->fcEnd) {
 #ifdef _WINDOWS
 	char szmess[80];
-	wsprintf(szmess, "read_paps: fcLimLast=%ld should be fcEnd=%ld.", fcLimLast, fcEnd);
+	wsprintf(szmess, "read_paps: fcLimLast=%ld should be fcEnd=%ld.", fcLimLast, rs->fcEnd);
 	MessageBox( 0, szmess, "WriteKit in error", MB_OK|MB_ICONSTOP );
 #else
-	fprintf(stderr, "read_paps: fcLimLast=%ld should be fcEnd=%ld.\n", fcLimLast, fcEnd);
+	fprintf(stderr, "read_paps: fcLimLast=%ld should be fcEnd=%ld.\n", fcLimLast, rs->fcEnd);
 #endif	    
 	return(1);
     }
@@ -440,29 +563,46 @@ read_paps(FILE *ifp, struct wri_header *hp, int want_paps, int want_tabs)
 
 /* Copy section info from an existing write file */
 static int
-read_section(FILE *ifp, struct wri_header *hp)
+read_section(wri_doc_t *doc, struct in_file *ip, struct wri_header *hp)
 {
-    struct SEP sep;	/* SEP as found in write file */
+    struct SEP sep;
+
+    /* If the read fails, do not modify the SEP */
+    if (get_sep(ip, hp, &sep)) return(1);
+
+    doc->section.sep = sep;
+    /* Recalculate the variables that the user deals with */
+    _wri_sep_to_user(doc);
+
+    return(0);
+}
+
+/*
+ * Find the section properties of the file, which are the default ones if it
+ * has none.
+ */
+static int
+get_sep(struct in_file *ip, struct wri_header *hp, struct SEP *sepp)
+{
+    struct SEP buf;	/* Room for the SEP if the file isn't mapped */
+    struct SEP *fsepp;	/* SEP as found in write file */
+
+    memcpy(sepp, &_wri_default_sep, sizeof(struct SEP));
 
     if (hp->pnSep + 1 == hp->pnSetb && hp->pnSetb + 1 == hp->pnPgtb) {
 	/* There are section properties */
-	if (read_page(hp->pnSep, sizeof(struct SEP), (char *)&sep, ifp)) {
-		/* Read failed - do not modify SEP */
-		return(1);
-	}
+	fsepp = (struct SEP *) read_page(ip, hp->pnSep, sizeof(struct SEP),
+					 (char *)&buf);
+	if (fsepp == NULL) return(1);
+
 	/* Copy the amount of the SEP that is defined - and be careful not to
 	 * overflow the amount of SEP that we define (empirically, Word
 	 * saves tons of section info, though we don't know what it means).
-	 * The byte _wri_sep.cch covers the whole sep, as always.
+	 * The byte fsepp->cch covers the whole sep, as always.
 	 * The macro min(a,b) is defined in defs.h.
 	 */
-	_wri_set_default_sep();
-	memcpy(&_wri_sep.res1, &sep.res1, min(sep.cch, sizeof(struct SEP)-1));
-	/* Recalculate the variables that the user deals with */
-	_wri_sep_to_user();
-    } else {
-	/* No section properties in file - set default values */
-	_wri_set_default_sep();
+	memcpy(&sepp->res1, &fsepp->res1,
+	       min(fsepp->cch, sizeof(struct SEP)-1));
     }
 
     return(0);
@@ -473,11 +613,41 @@ read_section(FILE *ifp, struct wri_header *hp)
  * those used in the file to those we will use in the output file.
  */
 static int
-read_fonts(FILE *ifp, struct wri_header *hp)
+read_fonts(wri_doc_t *doc, struct read_state *rs,
+	  struct in_file *ip, struct wri_header *hp)
+{
+    struct font_map_arg arg;
+
+    arg.doc = doc;
+    arg.rs = rs;
+    return(get_fonts(ip, hp, map_font, (void *) &arg));
+}
+
+static int
+map_font(void *arg, int ftc, const char *name, int ffid)
+{
+    struct font_map_arg *ap = (struct font_map_arg *) arg;
+
+    ap->rs->font_map[ftc] = _wri_cvt_font_name_to_code(ap->doc,
+					(char *) name, (unsigned char) ffid);
+
+    ap->rs->nfonts = ftc + 1;
+
+    /* Fail if _wri_cvt... failed */
+    return(ap->rs->font_map[ftc] == -1);
+}
+
+/*
+ * Call <fn> for each font in the file's font table, with its font code in
+ * the file, its name and its family.  Stop if it returns non-zero.
+ */
+static int
+get_fonts(struct in_file *ip, struct wri_header *hp,
+	  int (*fn)(void *arg, int ftc, const char *name, int ffid), void *arg)
 {
     char page[PAGESIZE];
+    char *end = page + PAGESIZE;
     PN pn;  /* page number of page of fonts that we are reading */
-    int cffn;	/* number of FFNs in current page */
     char *ffn;	/* current ffn */
     unsigned int cbFfn;
     int ftc;	/* font code */
@@ -487,18 +657,21 @@ read_fonts(FILE *ifp, struct wri_header *hp)
 	return(0);
     }
 
+    /* The FFNs start after the number of them, which we don't need */
     pn = hp->pnFfntb;
-    if (read_page(pn++, PAGESIZE, page, ifp)) return(1);
-    cffn = *(int *)page;
+    if (copy_page(ip, pn++, PAGESIZE, page)) return(1);
     ffn = &page[2];
 
     ftc = 0;
     do {
 	char *font_name;
+	char *nul;
 	unsigned char ffid;
 
-	cbFfn = *(int *)ffn;
-	ffn += sizeof(int);
+	/* Nothing in the page may be trusted to stay inside it */
+	if (ffn + 2 > end) return(1);
+	cbFfn = GETWORD(ffn);
+	ffn += 2;
 
 	switch (cbFfn) {
 	case 0:
@@ -506,19 +679,19 @@ read_fonts(FILE *ifp, struct wri_header *hp)
 	    break;
 	case 0xFFFF:
 	    /* More fonts on new page... */
-	    if (read_page(pn++, PAGESIZE, page, ifp)) return(1);
+	    if (copy_page(ip, pn++, PAGESIZE, page)) return(1);
 	    ffn = page;
 	    break;
 	default:
+	    if (ffn >= end) return(1);
 	    ffid = *ffn++;
 	    font_name = ffn;
-	    ffn += strlen(font_name)+1;
-
-	    font_map[ftc] = _wri_cvt_font_name_to_code(font_name, ffid);
-	    if (font_map[ftc] == -1) {
-		/* _wri_cvt... failed */
+	    if ((nul = memchr(ffn, '\0', (size_t) (end - ffn))) == NULL)
 		return(1);
-	    }
+	    ffn = nul + 1;
+
+	    if (ftc >= MAX_FONTS) return(1);
+	    if ((*fn)(arg, ftc, font_name, (int) ffid)) return(1);
 
 	    ftc++;
 	    break;
@@ -529,19 +702,328 @@ read_fonts(FILE *ifp, struct wri_header *hp)
 }
 
 /*
- *  Read <extent> bytes of the <n>th page (starting from 0) from the file into
- *  the buffer, detecting errors.
- *  <extent> will usually be == PAGESIZE.
+ * The core of wri_scan(): go through the text, moving along the tables of
+ * CHPs and PAPs together, and hand it over in pieces that have the same
+ * CHP and PAP all the way through.
  */
 static int
-read_page(PN n, int extent, char *buf, FILE *ifp)
+scan_file(struct in_file *ip, const struct wri_scan_fns *fns, void *ctx)
 {
-    if (fseek(ifp, (long) n * PAGESIZE, SEEK_SET) != 0) {
+    struct wri_header header;	/* header from Write file */
+    struct fkp_cursor chps, paps;	/* Where we are in the CHPs and PAPs */
+    struct wri_char_info ci;	/* The CHP of the current run of text */
+    struct wri_para_info pi;	/* The PAP of the current paragraph */
+    struct PAP pap;
+    struct CHP chp;
+    char buf[PAGESIZE];		/* Room for text if the file isn't mapped */
+    FC fc, fcLim;		/* The text being handed over */
+
+    if (read_header(ip, &header)) return(1);
+
+    if (fns->font != NULL && get_fonts(ip, &header, fns->font, ctx))
 	return(1);
+
+    if (fns->section != NULL) {
+	struct SEP sep;
+	struct wri_section_info si;
+
+	if (get_sep(ip, &header, &sep)) return(1);
+	si.page_width = sep.xaMac;
+	si.page_height = sep.yaMac;
+	si.margin_left = sep.xaLeft;
+	si.margin_right = sep.xaMac - sep.xaLeft - sep.dxaText;
+	si.margin_top = sep.yaTop;
+	si.margin_bottom = sep.yaMac - sep.yaTop - sep.dyaText;
+	si.distance_from_top = sep.yaHeader;
+	si.distance_from_bottom = sep.yaMac - sep.yaFooter;
+	si.number_from = (sep.pgnFirst == 0xFFFF) ? 1 : sep.pgnFirst;
+	if ((*fns->section)(ctx, &si)) return(1);
     }
 
-    if (fread((void *)buf, (size_t)1, (size_t)extent, ifp) != (size_t)extent) {
-	return(1);
+    chps.pn = pnChar(header);
+    chps.pnLim = header.pnPara;
+    paps.pn = header.pnPara;
+    paps.pnLim = header.pnFntb;
+    chps.fkpp = paps.fkpp = NULL;
+    chps.fcLim = paps.fcLim = PAGESIZE;
+
+    /* As for wri_read(), the tabs are those of the first PAP */
+    if (fns->tabs != NULL && header.fcMac > PAGESIZE) {
+	struct wri_tab tabs[itbdmax];
+	int n;
+
+	if (next_fod(ip, &paps)) return(1);
+	get_pap(paps.fkpp, paps.i - 1, &pap);
+	for (n = 0; n < itbdmax && pap.rgtbd[n].dxa != 0; n++) {
+	    tabs[n].position = pap.rgtbd[n].dxa;
+	    tabs[n].decimal = (pap.rgtbd[n].jcTab == WRI_DECIMAL);
+	}
+	if ((*fns->tabs)(ctx, n, tabs)) return(1);
+
+	/* Start the paragraphs again */
+	paps.pn = header.pnPara;
+	paps.fkpp = NULL;
+	paps.fcLim = PAGESIZE;
+    }
+
+    for (fc = PAGESIZE; fc < header.fcMac; fc = fcLim) {
+	/* Move on to the paragraph and the CHP that the text at fc has,
+	 * skipping any that cover no text */
+	if (paps.fcLim <= fc) {
+	    do {
+		if (next_fod(ip, &paps)) return(1);
+	    } while (paps.fcLim <= fc);
+	    get_pap(paps.fkpp, paps.i - 1, &pap);
+	    pi.justify = pap.jc;
+	    pi.interline = pap.dyaLine;
+	    pi.indent_left = pap.dxaLeft;
+	    pi.indent_right = pap.dxaRight;
+	    pi.indent_first = pap.dxaLeft1;
+	    pi.header = pap.rhcOdd && !pap.rhcPage;
+	    pi.footer = pap.rhcOdd && pap.rhcPage;
+	    pi.first_page = pap.rhcFirst;
+	    pi.picture = pap.fGraphics;
+	    if (fns->para != NULL && (*fns->para)(ctx, &pi)) return(1);
+	}
+	if (chps.fcLim <= fc) {
+	    do {
+		if (next_fod(ip, &chps)) return(1);
+	    } while (chps.fcLim <= fc);
+	    get_chp(chps.fkpp, chps.i - 1, &chp);
+	    ci.bold = chp.fBold;
+	    ci.italic = chp.fItalic;
+	    ci.underline = chp.fUline;
+	    ci.script = chp.hpsPos;
+	    ci.font_size = chp.hps / 2;
+	    ci.font = chp.ftc;
+	}
+
+	fcLim = min(min(chps.fcLim, paps.fcLim), header.fcMac);
+
+	if (fns->text != NULL) {
+	    FC from;
+	    size_t len;
+	    char *text;
+
+	    /* If the file is in memory, all in one go */
+	    for (from = fc; from < fcLim; from += len) {
+		len = (ip->map != NULL) ? (size_t) (fcLim - from) :
+			(size_t) min(fcLim - from, sizeof(buf));
+		if ((text = read_at(ip, from, len, buf)) == NULL ||
+		    (*fns->text)(ctx, text, len, &ci)) return(1);
+	    }
+	}
+    }
+
+    return(0);
+}
+
+/*
+ * Move on to the next FOD in a table of CHPs or PAPs, reading the next page
+ * of the table if need be, and note where its text ends.  A page that says
+ * it has more FODs than fit in it is rejected.
+ * Returns 0 if there is one, -1 if there are no more and 1 if the page is
+ * missing or damaged.
+ */
+static int
+next_fod(struct in_file *ip, struct fkp_cursor *cp)
+{
+    while (cp->fkpp == NULL || cp->i >= (int) cp->fkpp->cfod) {
+	if (cp->pn >= cp->pnLim) return(-1);
+	cp->fkpp = (struct FKP *) read_page(ip, cp->pn++, PAGESIZE,
+					    (char *) &cp->page);
+	if (cp->fkpp == NULL || cp->fkpp->cfod > MAX_FODS) return(1);
+	cp->i = 0;
+    }
+    cp->fcLim = cp->fkpp->rgFOD[cp->i++].fcLim;
+
+    return(0);
+}
+
+/*
+ * Decode the properties of the <i>th FOD of a page of CHPs or PAPs into
+ * <prop>, which is <size> bytes long: the default ones <deflt>, with the
+ * first few replaced by those from the page, if there are any.
+ */
+static void
+get_prop(struct FKP *fkpp, int i, char *prop, const char *deflt, size_t size)
+{
+    int bfprop = fkpp->rgFOD[i].bfprop;
+
+    memcpy(prop, deflt, size);
+
+    /* bfprop == -1 means the default properties */
+    if (bfprop >= 0 && bfprop < (int) sizeof(fkpp->rgFPROP)) {
+	struct FPROP *fpropp = (struct FPROP *) &(fkpp->rgFPROP[bfprop]);
+	size_t cch = fpropp->cch;
+
+	/* Copy in the part that differs from the default, as far as the
+	 * property and the page go */
+	cch = min(cch, size);
+	cch = min(cch, sizeof(fkpp->rgFPROP) - 1 - bfprop);
+	memcpy(prop, (char *) fpropp + 1, cch);
+    }
+}
+
+static void
+get_chp(struct FKP *fkpp, int i, struct CHP *chpp)
+{
+    get_prop(fkpp, i, (char *) chpp, (const char *) &_wri_default_chp,
+	     sizeof(struct CHP));
+
+    /* Set ignored byte to the same as the default so that the
+     * comparison with the default CHP works. */
+    chpp->res1 = _wri_default_chp.res1;
+    chpp->res2 = _wri_default_chp.res2;
+}
+
+static void
+get_pap(struct FKP *fkpp, int i, struct PAP *papp)
+{
+    get_prop(fkpp, i, (char *) papp, (const char *) &_wri_default_pap,
+	     sizeof(struct PAP));
+
+    /* Set ignored bytes to the same as the default so that the
+     * comparison with the default PAP works. */
+    papp->res1 = _wri_default_pap.res1;
+    papp->res2 = _wri_default_pap.res2;
+    papp->res3 = _wri_default_pap.res3;
+    papp->res4 = _wri_default_pap.res4;
+    papp->res5 = _wri_default_pap.res5;
+}
+
+/*
+ *  Open the Write file and map it if we can.  If it can't be mapped (it's
+ *  empty, say, or on a file system that doesn't allow it) we read it instead.
+ */
+static int
+open_in(struct in_file *ip, char *filename)
+{
+    ip->fp = fopen(filename, "rb");
+    if (ip->fp == NULL) return(1);
+    ip->map = NULL;
+    ip->size = 0;
+    ip->mapped = 0;
+
+#ifndef _WINDOWS
+    {
+	struct stat st;
+	size_t size;
+
+	if (fstat(fileno(ip->fp), &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size <= 0) {
+	    return(0);
+	}
+	size = (size_t) st.st_size;
+
+	if (st.st_size >= MAP_MIN) {
+	    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+			     fileno(ip->fp), (off_t) 0);
+
+	    if (map != MAP_FAILED) {
+		ip->map = (char *) map;
+		ip->mapped = 1;
+	    }
+	} else if ((ip->map = malloc(size)) != NULL &&
+		   pread(fileno(ip->fp), ip->map, size, (off_t) 0) !=
+		   (ssize_t) size) {
+	    free(ip->map);
+	    ip->map = NULL;
+	}
+	if (ip->map != NULL) ip->size = (FC) size;
+    }
+#endif
+
+    return(0);
+}
+
+static void
+close_in(struct in_file *ip)
+{
+#ifndef _WINDOWS
+    if (ip->mapped) (void) munmap((void *) ip->map, (size_t) ip->size);
+#endif
+    if (ip->map != NULL && !ip->mapped) free(ip->map);
+    (void) fclose(ip->fp);
+}
+
+/*
+ *  Find <extent> bytes of the <n>th page (starting from 0) of the file.
+ *  If it is mapped, they are used where they are; otherwise they are read
+ *  into <buf>.  Returns where they are, or NULL if they aren't all there.
+ *  <extent> will usually be == PAGESIZE.
+ */
+static char *
+read_page(struct in_file *ip, PN n, int extent, char *buf)
+{
+    return(read_at(ip, (FC) n * PAGESIZE, (size_t) extent, buf));
+}
+
+/*
+ *  The same, for <len> bytes from anywhere in the file.
+ */
+static char *
+read_at(struct in_file *ip, FC offset, size_t len, char *buf)
+{
+    if (ip->map != NULL) {
+	if (offset + len > ip->size) return(NULL);
+	return(ip->map + offset);
+    }
+
+#ifndef _WINDOWS
+    if (pread(fileno(ip->fp), (void *)buf, len, (off_t) offset) !=
+	(ssize_t)len) {
+	return(NULL);
+    }
+#else
+    if (fseek(ip->fp, (long) offset, SEEK_SET) != 0) {
+	return(NULL);
     }
+
+    if (fread((void *)buf, (size_t)1, len, ip->fp) != len) {
+	return(NULL);
+    }
+#endif
+    return(buf);
+}
+
+/*
+ *  The same, always putting them in <buf>: for the header, and for the font
+ *  pages, whose last FFN may be read as an int running past the end of it.
+ */
+static int
+copy_page(struct in_file *ip, PN n, int extent, char *buf)
+{
+    char *cp = read_page(ip, n, extent, buf);
+
+    if (cp == NULL) return(1);
+    if (cp != buf) memcpy(buf, cp, (size_t)extent);
     return(0);
 }
+
+/*
+ *  The same functions, acting on the default document
+ */
+int
+wri_open(char *filename)
+{
+    return(wri_open_r(_wri_default_doc(), filename));
+}
+
+int
+wri_read(char *filename, int what)
+{
+    return(wri_read_r(_wri_default_doc(), filename, what));
+}
+
+int
+wri_open_mem(const void *buf, size_t len)
+{
+    return(wri_open_mem_r(_wri_default_doc(), buf, len));
+}
+
+int
+wri_read_mem(const void *buf, size_t len, int what)
+{
+    return(wri_read_mem_r(_wri_default_doc(), buf, len, what));
+}
@@ -8,100 +8,961 @@
 
 #include <stdio.h>
 #include <stdlib.h> /* for exit() */
+#include <string.h> /* for strlen() */
+#include <malloc.h> /* for malloc() */
+#ifndef _WINDOWS
+# include <errno.h>	/* for errno */
+# include <pthread.h>	/* for pthread_create() */
+# include <unistd.h>	/* for ftruncate() and pwrite() */
+#endif
+#if defined(__linux__)
+# include <fcntl.h>	/* for posix_fallocate() */
+#endif
 #include "libwrite.h"	/* Public definitions */
 #include "write.h"	/* Data structures for Write documents */
 #include "defs.h"	/* Definitions internal to the library */
 
+/*
+ * The pages after the text, which are encoded in a thread of their own while
+ * the text is being written.  Where there are no threads, or one can't be
+ * started, they are encoded by the calling thread before it writes the text.
+ */
+struct save_task {
+    struct fkp_plan *chp, *pap;
+    struct page_buf *section, *fonts;
+    char *pages;	/* Where to put them */
+#ifndef _WINDOWS
+    pthread_t thread;
+    int started;	/* Is it running in that thread? */
+#endif
+};
+
+/*
+ * A save being done a step at a time by wri_save_step().
+ * <done> is how much of the text, or how many of the pages after it, have
+ * been written.
+ */
+struct save_job {
+    struct wri_header header;
+    struct sink sink;
+    char *filename;	/* Of the output file, if it is one */
+    struct fkp_plan chp, pap;
+    struct page_buf section, fonts;
+    char *pages;	/* All the pages after the text */
+    unsigned long npages;	/* and how many there are */
+    int phase;		/* What it's doing: one of JOB_* */
+    FC done;
+};
+
+#define JOB_HEADER 0
+#define JOB_TEXT 1
+#define JOB_PAGES 2
+#define JOB_DONE 3
+#define JOB_FAILED 4
+
 /* Function prototypes */
-static int save_header(struct wri_header *hp, FILE *ofp);
+static struct save_job *new_job(wri_doc_t *doc);
+static int start_job(wri_doc_t *doc, struct save_job *jp);
+static void free_job(struct save_job *jp);
+static int save_file(wri_doc_t *doc, struct wri_header *hp, struct sink *sp);
+static int plan_file(wri_doc_t *doc, struct wri_header *hp,
+		     struct fkp_plan *chp, struct fkp_plan *pap,
+		     struct page_buf *section, struct page_buf *fonts);
+static int write_stream(void *ctx, const char *buf, size_t len);
+static void *fill_task(void *arg);
+static void start_task(struct save_task *tp, void *(*fn)(void *));
+static void finish_task(struct save_task *tp);
+static char *alloc_pages(unsigned long n);
+static int reserve(wri_doc_t *doc, struct sink *sp, FC size);
+static int write_file(wri_doc_t *doc, FILE *ofp, FC offset, char *buf,
+		      size_t len);
+static int save_header(wri_doc_t *doc, struct wri_header *hp, struct sink *sp);
+static void forget_stream(wri_doc_t *doc);
+
+/*
+ * The output file of a document started with wri_begin(), into which the text
+ * is written as it arrives, and its name, in case we have to remove it, are
+ * in the document's struct save_state.
+ */
 
 int
-wri_save(char *filename)
+wri_save_r(wri_doc_t *doc, char *filename)
 {
-    /* Header is static for free zeroing of unused elements */
-    static struct wri_header header;
-    FILE *ofp;	/* Output file pointer */
+    struct wri_header header;
+    struct sink sink;
+
+    /* Unused elements of the header must be zero */
+    memset(&header, 0, sizeof(header));
+    memset(&sink, 0, sizeof(sink));
 
     /* Create output file */
-    ofp = fopen(filename, "wb");
-    if (ofp == NULL) {
-	_wri_error = 1;
+    sink.fp = fopen(filename, "wb");
+    if (sink.fp == NULL) {
+	doc->error = 1;
+	return(1);
+    }
+
+    if (save_file(doc, &header, &sink)) goto fail;
+
+    if (fclose(sink.fp) != 0) goto fail2;
+
+    return(0);
+
+fail:
+    /* Something failed during writing of the file.
+     * Remove the half-baked output file
+     */
+    (void) fclose(sink.fp);
+fail2:
+    (void) remove(filename);
+
+    doc->error = 1;
+    return(1);
+}
+
+/*
+ * Save the document into a buffer obtained from malloc(), which the caller
+ * must free(), returning its address in *bufp and its length in *lenp.
+ * If it fails, they are left alone.
+ */
+int
+wri_save_mem_r(wri_doc_t *doc, void **bufp, size_t *lenp)
+{
+    struct wri_header header;
+    struct sink sink;
+
+    memset(&header, 0, sizeof(header));
+    memset(&sink, 0, sizeof(sink));
+
+    if (save_file(doc, &header, &sink)) {
+	if (sink.mem != NULL) free(sink.mem);
+	doc->error = 1;
+	return(1);
+    }
+
+    *bufp = (void *) sink.mem;
+    *lenp = sink.mem_len;
+
+    return(0);
+}
+
+/*
+ * Save the document by handing its bytes, in order from the first, to
+ * (*write_fn)(ctx, buf, len), which returns 0 if all went well.
+ * If it returns anything else, the save is abandoned.
+ */
+int
+wri_save_sink_r(wri_doc_t *doc, wri_write_fn write_fn, void *ctx)
+{
+    struct wri_header header;
+    struct sink sink;
+
+    memset(&header, 0, sizeof(header));
+    memset(&sink, 0, sizeof(sink));
+    sink.write_fn = write_fn;
+    sink.ctx = ctx;
+
+    if (save_file(doc, &header, &sink)) {
+	doc->error = 1;
+	return(1);
+    }
+
+    return(0);
+}
+
+/*
+ * Save the document into a file that is already open, which may be a pipe,
+ * a socket or the standard output, since it is written from start to end
+ * without seeking.  The file is left open.
+ */
+int
+wri_save_stream_r(wri_doc_t *doc, FILE *ofp)
+{
+    if (wri_save_sink_r(doc, write_stream, (void *) ofp) ||
+	fflush(ofp) != 0 || ferror(ofp)) {
+	doc->error = 1;
+	return(1);
+    }
+
+    return(0);
+}
+
+/*
+ * How many bytes the file will be if the document is saved now, or 0 if we
+ * can't tell.  Only the plan of the file is made, so it costs a fraction of
+ * a save.
+ */
+size_t
+wri_saved_size_r(wri_doc_t *doc)
+{
+    struct wri_header header;
+    struct fkp_plan chp, pap;
+    struct page_buf section, fonts;
+    size_t size = 0;
+
+    memset(&header, 0, sizeof(header));
+    memset(&chp, 0, sizeof(chp));
+    memset(&pap, 0, sizeof(pap));
+    memset(&section, 0, sizeof(section));
+    memset(&fonts, 0, sizeof(fonts));
+
+    if (plan_file(doc, &header, &chp, &pap, &section, &fonts) == 0) {
+	size = (size_t) header.pnMac * PAGESIZE;
+    }
+
+    _wri_free_fkp(&chp);
+    _wri_free_fkp(&pap);
+    _wri_free_pages(&section);
+    _wri_free_pages(&fonts);
+
+    return(size);
+}
+
+/*
+ * Start a new document that will be saved in the named file.
+ * The text is written into the file as it arrives, and only the character,
+ * paragraph, section and font information are kept in memory, to be added
+ * to the file by wri_end().  This saves copying the text at the end.
+ */
+int
+wri_begin_r(wri_doc_t *doc, char *filename)
+{
+    if (wri_new_r(doc)) return(1);
+
+    /* Open it for reading too, in case they wri_save() a copy of it */
+    doc->save.stream_fp = fopen(filename, "w+b");
+    if (doc->save.stream_fp == NULL) {
+	doc->error = 1;
+	return(1);
+    }
+
+    doc->save.stream_name = malloc(strlen(filename) + 1);
+    if (doc->save.stream_name == NULL ||
+	_wri_direct_text(doc, doc->save.stream_fp)) {
+	(void) fclose(doc->save.stream_fp);
+	(void) remove(filename);
+	forget_stream(doc);
+	doc->error = 1;
+	return(1);
+    }
+    strcpy(doc->save.stream_name, filename);
+
+    return(0);
+}
+
+/*
+ * Finish a document started with wri_begin(): add the character, paragraph,
+ * section and font information to the file after the text, fill in the
+ * header and close it.  The document is then forgotten, as with wri_new().
+ */
+int
+wri_end_r(wri_doc_t *doc)
+{
+    struct wri_header header;
+    struct sink sink;
+    int failed;
+
+    if (doc->save.stream_fp == NULL) return(1);	/* No wri_begin() */
+
+    memset(&header, 0, sizeof(header));
+    memset(&sink, 0, sizeof(sink));
+    sink.fp = doc->save.stream_fp;
+
+    failed = save_file(doc, &header, &sink);
+
+#ifndef _WINDOWS
+    /* A wri_read() that failed may have left bogus text beyond the end */
+    if (!failed) {
+	failed = fflush(doc->save.stream_fp) != 0 ||
+		 ftruncate(fileno(doc->save.stream_fp),
+			   (off_t)header.pnMac * PAGESIZE) != 0;
+    }
+#endif
+
+    if (fclose(doc->save.stream_fp) != 0) failed = 1;
+    if (failed) (void) remove(doc->save.stream_name);
+    forget_stream(doc);
+
+    /* Free the rest of the document */
+    (void) wri_new_r(doc);
+
+    if (failed) {
+	doc->error = 1;
 	return(1);
     }
+    return(0);
+}
+
+/*
+ * Save a document a step at a time, for programs that can't stop for as long
+ * as a whole save takes.  wri_save_begin() makes the plan of the file, then
+ * each wri_save_step() writes the next few pages of it, in order, and
+ * wri_save_end() closes the file, or abandons the save if it isn't finished.
+ * The document must not change in the meantime.
+ */
+int
+wri_save_begin_r(wri_doc_t *doc, char *filename)
+{
+    struct save_job *jp;
+
+    if (doc->save.job != NULL) return(1);	/* One at a time */
+
+    jp = new_job(doc);
+    if (jp == NULL) return(1);
+
+    jp->sink.fp = fopen(filename, "wb");
+    jp->filename = malloc(strlen(filename) + 1);
+    if (jp->sink.fp == NULL || jp->filename == NULL) {
+	if (jp->sink.fp != NULL) (void) fclose(jp->sink.fp);
+	free_job(jp);
+	doc->error = 1;
+	return(1);
+    }
+    strcpy(jp->filename, filename);
+
+    return(start_job(doc, jp));
+}
+
+/* The same, handing the bytes of the file to (*write_fn)(ctx, buf, len) */
+int
+wri_save_begin_sink_r(wri_doc_t *doc, wri_write_fn write_fn, void *ctx)
+{
+    struct save_job *jp;
+
+    if (doc->save.job != NULL) return(1);
+
+    jp = new_job(doc);
+    if (jp == NULL) return(1);
+
+    jp->sink.write_fn = write_fn;
+    jp->sink.ctx = ctx;
+
+    return(start_job(doc, jp));
+}
+
+/*
+ * Write about <budget> more pages of the file: the header, then the text,
+ * then the pages after it.  Returns WRI_SAVE_MORE until it has all been
+ * written, then WRI_SAVE_DONE, or WRI_SAVE_ERROR if something failed.
+ */
+int
+wri_save_step_r(wri_doc_t *doc, unsigned long budget)
+{
+    struct save_job *jp = doc->save.job;
+    struct wri_header *hp;
+    int failed = 0;
+
+    if (jp == NULL || jp->phase == JOB_FAILED) return(WRI_SAVE_ERROR);
+    hp = &jp->header;
+
+    if (budget == 0) budget = 1;	/* Always get somewhere */
+
+    while (budget > 0 && jp->phase < JOB_DONE && !failed) {
+	switch (jp->phase) {
+	case JOB_HEADER:
+	    failed = save_header(doc, hp, &jp->sink);
+	    budget--;
+	    jp->phase = JOB_TEXT;
+	    break;
+
+	case JOB_TEXT: {
+	    CP len = doc->text.cpMac - jp->done;
+
+	    /* Compare in pages, as a huge budget would overflow in bytes */
+	    if (budget <= len / PAGESIZE) len = (CP) budget * PAGESIZE;
+
+	    failed = _wri_save_text_part(doc, &jp->sink, jp->done, len);
+	    jp->done += len;
+	    budget -= (len + PAGESIZE - 1) / PAGESIZE;
+	    if (jp->done == doc->text.cpMac) {
+		/* As in save_file(), before the rest goes in after it */
+		if (!failed && jp->sink.fp != NULL) {
+		    failed = fflush(jp->sink.fp) != 0 || ferror(jp->sink.fp);
+		}
+		jp->phase = JOB_PAGES;
+		jp->done = 0;
+	    }
+	    break;
+	}
+
+	case JOB_PAGES: {
+	    unsigned long from = jp->done;
+	    unsigned long to = budget >= jp->npages - from ? jp->npages
+							  : from + budget;
+	    unsigned long nchp = jp->chp.npages;
+	    unsigned long npap = jp->pap.npages;
+
+	    if (from < nchp) {
+		_wri_fill_fkp_pages(&jp->chp, jp->pages, from, min(to, nchp));
+	    }
+	    if (to > nchp && from < nchp + npap) {
+		_wri_fill_fkp_pages(&jp->pap, jp->pages + nchp * PAGESIZE,
+				    from > nchp ? from - nchp : 0UL,
+				    min(to, nchp + npap) - nchp);
+	    }
+	    failed = _wri_sink_write(doc, &jp->sink,
+				     (FC) (pnChar(*hp) + from) * PAGESIZE,
+				     jp->pages + from * PAGESIZE,
+				     (size_t) (to - from) * PAGESIZE);
+	    jp->done = to;
+	    budget -= to - from;
+	    if (to == jp->npages) jp->phase = JOB_DONE;
+	    break;
+	}
+	}
+    }
+
+    if (failed) {
+	jp->phase = JOB_FAILED;
+	doc->error = 1;
+	return(WRI_SAVE_ERROR);
+    }
+    return(jp->phase == JOB_DONE ? WRI_SAVE_DONE : WRI_SAVE_MORE);
+}
+
+/*
+ * Finish a save started with wri_save_begin(): close the file and forget the
+ * plan.  If it hasn't all been written, it is abandoned and the file removed,
+ * so this also cancels a save.  Returns 0 if the file was saved.
+ */
+int
+wri_save_end_r(wri_doc_t *doc)
+{
+    struct save_job *jp = doc->save.job;
+    int failed;
+
+    if (jp == NULL) return(1);	/* No wri_save_begin() */
+
+    failed = (jp->phase != JOB_DONE);
+    if (jp->sink.fp != NULL) {
+	if (fclose(jp->sink.fp) != 0) failed = 1;
+	if (failed) (void) remove(jp->filename);
+    }
+
+    free_job(jp);
+    doc->save.job = NULL;
+
+    return(failed);
+}
+
+/* Make a new, empty save job, or NULL if we are out of memory */
+static struct save_job *
+new_job(wri_doc_t *doc)
+{
+    struct save_job *jp = calloc((size_t) 1, sizeof(struct save_job));
+
+    if (jp == NULL) doc->error = 1;
+    return(jp);
+}
+
+/* Plan the file for a save job and make it the document's one */
+static int
+start_job(wri_doc_t *doc, struct save_job *jp)
+{
+    struct wri_header *hp = &jp->header;
+    char *cp;
+
+    if (plan_file(doc, hp, &jp->chp, &jp->pap, &jp->section, &jp->fonts))
+	goto fail;
+
+    jp->npages = jp->chp.npages + jp->pap.npages +
+		 jp->section.n + jp->fonts.n;
+    jp->pages = alloc_pages(jp->npages);
+    if (jp->pages == NULL || reserve(doc, &jp->sink, (FC) hp->pnMac * PAGESIZE))
+	goto fail;
+
+    /* The section and font pages are ready now */
+    cp = jp->pages + (jp->chp.npages + jp->pap.npages) * PAGESIZE;
+    if (jp->section.n > 0) {
+	memcpy(cp, jp->section.data, (size_t) jp->section.n * PAGESIZE);
+	cp += jp->section.n * PAGESIZE;
+    }
+    memcpy(cp, jp->fonts.data, (size_t) jp->fonts.n * PAGESIZE);
+
+    jp->phase = JOB_HEADER;
+    doc->save.job = jp;
+    return(0);
+
+fail:
+    if (jp->sink.fp != NULL) {
+	(void) fclose(jp->sink.fp);
+	(void) remove(jp->filename);
+    }
+    free_job(jp);
+    doc->error = 1;
+    return(1);
+}
+
+static void
+free_job(struct save_job *jp)
+{
+    _wri_free_fkp(&jp->chp);
+    _wri_free_fkp(&jp->pap);
+    _wri_free_pages(&jp->section);
+    _wri_free_pages(&jp->fonts);
+    if (jp->pages != NULL) free(jp->pages);
+    if (jp->filename != NULL) free(jp->filename);
+    free((char *) jp);
+}
+
+/*
+ * Abandon a document started with wri_begin() and not finished with
+ * wri_end(), removing the half-baked output file, and any save started with
+ * wri_save_begin() and not finished with wri_save_end().
+ */
+int
+_wri_reinit_save(wri_doc_t *doc)
+{
+    if (doc->save.job != NULL) (void) wri_save_end_r(doc);
+
+    if (doc->save.stream_fp != NULL) {
+	(void) fclose(doc->save.stream_fp);
+	(void) remove(doc->save.stream_name);
+	forget_stream(doc);
+    }
+
+    return(0);
+}
+
+static void
+forget_stream(wri_doc_t *doc)
+{
+    if (doc->save.stream_name != NULL) free(doc->save.stream_name);
+    doc->save.stream_name = NULL;
+    doc->save.stream_fp = NULL;
+}
+
+/*
+ * Write the whole document into a file, a buffer or the caller's function.
+ *
+ * Where each part of the file goes depends on the size of the parts before
+ * it, so we first work out how many pages each part takes, and then make
+ * the file that size in one go.  The pages of character, paragraph, section
+ * and font info, which follow the text in that order, are encoded into one
+ * buffer in a thread of their own while we write the header and the text.
+ * That buffer is then written with a single system call.  Everything is
+ * written in order, so the caller's function never has to go back.
+ */
+static int
+save_file(wri_doc_t *doc, struct wri_header *hp, struct sink *sp)
+{
+    struct save_task fill;	/* Encoded in a thread of its own */
+    struct fkp_plan chp, pap;	/* Character and paragraph info */
+    struct page_buf section, fonts;
+    char *pages = NULL;	/* All the pages after the text */
+    unsigned long npages = 0;	/* and how many there are */
+    int failed;
+
+    memset(&fill, 0, sizeof(fill));
+    memset(&chp, 0, sizeof(chp));
+    memset(&pap, 0, sizeof(pap));
+    memset(&section, 0, sizeof(section));
+    memset(&fonts, 0, sizeof(fonts));
+
+    failed = plan_file(doc, hp, &chp, &pap, &section, &fonts);
+
+    if (!failed) {
+	npages = chp.npages + pap.npages + section.n + fonts.n;
+	pages = alloc_pages(npages);
+	failed = (pages == NULL) ||
+		 reserve(doc, sp, (FC) hp->pnMac * PAGESIZE);
+    }
+
+    if (!failed) {
+	fill.chp = &chp;
+	fill.pap = &pap;
+	fill.section = &section;
+	fill.fonts = &fonts;
+	fill.pages = pages;
+	start_task(&fill, fill_task);
+
+	failed = save_header(doc, hp, sp) || _wri_save_text(doc, sp);
+
+	finish_task(&fill);
+
+	/* What stdio has buffered of the text must be in the file before
+	 * the rest goes in after it.
+	 * If the disk fills, the only way to detect it is through ferror()
+	 * because the write that fails may be one done by stdio behind our
+	 * back.
+	 */
+	if (!failed && sp->fp != NULL) {
+	    failed = fflush(sp->fp) != 0 || ferror(sp->fp);
+	}
+
+	if (!failed) {
+	    failed = _wri_sink_write(doc, sp, (FC) pnChar(*hp) * PAGESIZE,
+				     pages, (size_t) npages * PAGESIZE);
+	}
+    }
+
+    _wri_free_fkp(&chp);
+    _wri_free_fkp(&pap);
+    _wri_free_pages(&section);
+    _wri_free_pages(&fonts);
+    if (pages != NULL) free(pages);
+
+    return(failed);
+}
 
+/*
+ * Work out how many pages each part of the file takes, and so fill in the
+ * header.  The section and font info are small, so they are encoded now.
+ * The fields of the header are in the order of the parts of the file.
+ */
+static int
+plan_file(wri_doc_t *doc, struct wri_header *hp,
+	  struct fkp_plan *chp, struct fkp_plan *pap,
+	  struct page_buf *section, struct page_buf *fonts)
+{
     /* In case they have started a header or footer and not finished it,
      * we close it for them.  If we're not in header/footer, it does nothing
      */
-    wri_doc_return();
+    wri_doc_return_r(doc);
 
-    /* These functions fill in their information in the header, so the
-     * order in which they are called must correspond to the order of their
-     * size fields in the header structure.
+    /* Make the last changes to the document before the threads see it.
+     * Make sure values of sep.d[xy]aText reflect reality (since the user
+     * specifies margins, but the SEP talks in text areas).
      */
-    if (_wri_save_text(&header, ofp)) goto fail;
-    if (_wri_save_chp(&header, ofp)) goto fail;
-    if (_wri_save_pap(&header, ofp)) goto fail;
+    if (_wri_finish_chp(doc)) return(1);
+    _wri_user_to_sep(doc);
 
-    header.pnSep = header.pnFntb;   /* No footnote table */
+    hp->fcMac = doc->text.cpMac + PAGESIZE;
 
-    if (_wri_save_section(&header, ofp)) goto fail;
+    if (_wri_plan_chp(doc, chp)) return(1);
+    hp->pnPara = pnChar(*hp) + chp->npages;
 
-    header.pnFfntb = header.pnPgtb; /* No page table */
+    if (_wri_plan_pap(doc, pap)) return(1);
+    hp->pnFntb = hp->pnPara + pap->npages;
 
-    if (_wri_save_fonts(&header, ofp)) goto fail;
-    if (save_header(&header, ofp)) goto fail;
+    hp->pnSep = hp->pnFntb;   /* No footnote table */
 
-    /* If the disk fills at the last sector, th only way to detect it is through
-     * ferror() because the following happens:
-     * the last fwrite() doesn't really write to the disk because of buffering.
-     * This happens when we fseek() back to the beginning to write the
-     * header; though the writing fails, the fseek in itself succeeds.
-     * The trace of the failed write remains in ferror, however.
-     */
-    if (ferror(ofp)) goto fail;
+    if (_wri_save_section(doc, hp, section)) return(1);
+
+    hp->pnFfntb = hp->pnPgtb; /* No page table */
 
-    if (fclose(ofp) != 0) goto fail2;
+    if (_wri_save_fonts(doc, fonts)) return(1);
+    hp->pnMac = hp->pnFfntb + fonts->n;
 
     return(0);
+}
 
-fail:
-    /* Something failed during writing of the file.
-     * Remove the half-baked output file
-     */
-    (void) fclose(ofp);
-fail2:
-    (void) remove(filename);
+/* The write function for wri_save_stream() */
+static int
+write_stream(void *ctx, const char *buf, size_t len)
+{
+    return(fwrite(buf, (size_t)1, len, (FILE *) ctx) != len);
+}
 
-    _wri_error = 1;
-    return(1);
+static void *
+fill_task(void *arg)
+{
+    struct save_task *tp = (struct save_task *) arg;
+    char *cp = tp->pages;
+
+    _wri_fill_fkp(tp->chp, cp);
+    cp += tp->chp->npages * PAGESIZE;
+    _wri_fill_fkp(tp->pap, cp);
+    cp += tp->pap->npages * PAGESIZE;
+    if (tp->section->n > 0) {
+	memcpy(cp, tp->section->data, (size_t) tp->section->n * PAGESIZE);
+	cp += tp->section->n * PAGESIZE;
+    }
+    memcpy(cp, tp->fonts->data, (size_t) tp->fonts->n * PAGESIZE);
+
+    return(NULL);
+}
+
+static void
+start_task(struct save_task *tp, void *(*fn)(void *))
+{
+#ifndef _WINDOWS
+    tp->started = (pthread_create(&tp->thread, NULL, fn, (void *) tp) == 0);
+    if (tp->started) return;
+#endif
+    (void) (*fn)((void *) tp);
+}
+
+static void
+finish_task(struct save_task *tp)
+{
+#ifndef _WINDOWS
+    if (tp->started) (void) pthread_join(tp->thread, NULL);
+#endif
+}
+
+/*
+ * Allocate n pages of zeroes, aligned on a memory page where we can so that
+ * the kernel can take them straight from there.  NULL if out of memory.
+ */
+static char *
+alloc_pages(unsigned long n)
+{
+    size_t size = (size_t) (n == 0 ? 1 : n) * PAGESIZE;
+    void *pages;
+
+#ifndef _WINDOWS
+    if (posix_memalign(&pages, (size_t) 4096, size) != 0) return(NULL);
+#else
+    if ((pages = malloc(size)) == NULL) return(NULL);
+#endif
+    memset(pages, 0, size);
+
+    return((char *) pages);
+}
+
+/*
+ * Make room for the whole document, <size> bytes, in one go.
+ * A file is made that long, so that we find out now if the disk is full and
+ * the file system doesn't have to extend the file bit by bit.  Not all file
+ * systems can do it, which is no reason to fail.
+ * A buffer in memory is allocated full of zeroes, which are what goes in the
+ * gaps between the parts.
+ */
+static int
+reserve(wri_doc_t *doc, struct sink *sp, FC size)
+{
+    if (sp->fp != NULL) {
+#if defined(__linux__)
+	int err = posix_fallocate(fileno(sp->fp), (off_t) 0, (off_t) size);
+
+	if (err == ENOSPC || err == EFBIG) {
+	    doc->error = 1;
+	    return(1);
+	}
+#endif
+	return(0);
+    }
+
+    if (sp->write_fn == NULL) {
+	sp->mem = calloc((size_t) size, (size_t) 1);
+	if (sp->mem == NULL) {
+	    doc->error = 1;
+	    return(1);
+	}
+	sp->mem_len = (size_t) size;
+    }
+
+    return(0);
+}
+
+/*
+ * Write <len> bytes at <offset> in the document being saved.
+ * The caller's function has to be given them in order, so we fill any gap
+ * since the last call with zeroes and can't go back.
+ */
+int
+_wri_sink_write(wri_doc_t *doc, struct sink *sp, FC offset, char *buf,
+		size_t len)
+{
+    static char zeroes[PAGESIZE];
+
+    if (sp->fp != NULL) return(write_file(doc, sp->fp, offset, buf, len));
+
+    if (sp->write_fn == NULL) {
+	if (offset + len > sp->mem_len) {
+	    doc->error = 1;
+	    return(1);
+	}
+	memcpy(sp->mem + offset, buf, len);
+	return(0);
+    }
+
+    if (offset < sp->written) {
+	doc->error = 1;
+	return(1);
+    }
+    while (sp->written < offset) {
+	size_t gap = (size_t) min(offset - sp->written, (FC) PAGESIZE);
+
+	if ((*sp->write_fn)(sp->ctx, zeroes, gap) != 0) {
+	    doc->error = 1;
+	    return(1);
+	}
+	sp->written += gap;
+    }
+    if (len > 0 && (*sp->write_fn)(sp->ctx, buf, len) != 0) {
+	doc->error = 1;
+	return(1);
+    }
+    sp->written += len;
+
+    return(0);
+}
+
+/*
+ * Write <len> bytes into the file at <offset>.
+ * We use the file descriptor, with explicit offsets, where we can.
+ */
+static int
+write_file(wri_doc_t *doc, FILE *ofp, FC offset, char *buf, size_t len)
+{
+#ifndef _WINDOWS
+    off_t pos = (off_t) offset;
+
+    while (len > 0) {
+	ssize_t done = pwrite(fileno(ofp), buf, len, pos);
+
+	if (done < 0 && errno == EINTR) continue;
+	if (done <= 0) {
+	    doc->error = 1;
+	    return(1);
+	}
+	buf += done;
+	len -= done;
+	pos += done;
+    }
+#else
+    if (len == 0) return(0);
+
+    if (fseek(ofp, (long) offset, SEEK_SET) != 0 ||
+	fwrite(buf, (size_t) 1, len, ofp) != len ||
+	fflush(ofp) != 0) {
+	doc->error = 1;
+	return(1);
+    }
+#endif
+
+    return(0);
 }
 
 static int
-save_header(struct wri_header *hp, FILE *ofp)
+save_header(wri_doc_t *doc, struct wri_header *hp, struct sink *sp)
 {
+    char page[PAGESIZE];	/* The header, as a page */
+
     hp->wIdent = WRIH_WIDENT;
     hp->wTool  = WRIH_WTOOL;
 
-    if (_wri_seek_to_page((PN)0, ofp)) return(1);
+    memset(page, 0, sizeof(page));
+    memcpy(page, (char *) hp, sizeof(*hp));
 
-    if (fwrite((void *)hp, (size_t) sizeof(*hp), (size_t) 1, ofp) != 1) {
-	_wri_error = 1;
-	return(1);
+    return(_wri_sink_write(doc, sp, (FC) 0, page, sizeof(page)));
+}
+
+/*
+ * Add n pages, all zeroes, to the end of a buffer of encoded pages and return
+ * the address of the first of them, or NULL if we are out of memory.
+ * The buffer grows by doubling, as the tables of runs do.
+ */
+char *
+_wri_new_pages(struct page_buf *pb, unsigned long n)
+{
+    char *page;
+
+    if (pb->n + n > pb->max) {
+	unsigned long new_max = (pb->max == 0) ? 16 : pb->max * 2;
+	char *new_data;
+
+	if (new_max < pb->n + n) new_max = pb->n + n;
+	new_data = realloc(pb->data, (size_t) new_max * PAGESIZE);
+	if (new_data == NULL) return(NULL);
+	pb->data = new_data;
+	pb->max = new_max;
     }
+    page = pb->data + pb->n * PAGESIZE;
+    memset(page, 0, (size_t) n * PAGESIZE);
+    pb->n += n;
+
+    return(page);
+}
+
+/* Add a copy of a page to the end of a buffer of encoded pages */
+int
+_wri_add_page(struct page_buf *pb, char *page)
+{
+    char *new_page = _wri_new_pages(pb, 1UL);
+
+    if (new_page == NULL) return(1);
+    memcpy(new_page, page, (size_t) PAGESIZE);
 
     return(0);
 }
 
+void
+_wri_free_pages(struct page_buf *pb)
+{
+    if (pb->data != NULL) free(pb->data);
+    pb->data = NULL;
+    pb->n = pb->max = 0;
+}
+
+/*
+ * Call fn(arg, from, to) on ranges of items that together go from 0 to n,
+ * in several threads at once if there are enough items to be worth it.
+ * Each call must only touch its own items.
+ */
+#define MAX_THREADS 8		/* Most threads to share the work between */
+#define MIN_PER_THREAD 16384	/* Fewest items worth starting a thread for */
+
+#ifndef _WINDOWS
+struct parallel_task {
+    void (*fn)(void *arg, unsigned long from, unsigned long to);
+    void *arg;
+    unsigned long from, to;
+    pthread_t thread;
+    int started;
+};
+
+static void *
+parallel_task(void *arg)
+{
+    struct parallel_task *tp = (struct parallel_task *) arg;
+
+    (*tp->fn)(tp->arg, tp->from, tp->to);
+    return(NULL);
+}
+#endif
+
+void
+_wri_parallel(unsigned long n,
+	      void (*fn)(void *arg, unsigned long from, unsigned long to),
+	      void *arg)
+{
+#ifndef _WINDOWS
+    struct parallel_task task[MAX_THREADS];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long nthreads = n / MIN_PER_THREAD;
+    unsigned long i;
+
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+    if (ncpu > 0 && nthreads > (unsigned long) ncpu) nthreads = ncpu;
+
+    if (nthreads > 1) {
+	/* The first range is done by this thread, the others in their own */
+	for (i = 1; i < nthreads; i++) {
+	    task[i].fn = fn;
+	    task[i].arg = arg;
+	    task[i].from = n * i / nthreads;
+	    task[i].to = n * (i + 1) / nthreads;
+	    task[i].started = (pthread_create(&task[i].thread, NULL,
+					      parallel_task,
+					      (void *) &task[i]) == 0);
+	}
+	(*fn)(arg, 0UL, n / nthreads);
+
+	/* If a thread couldn't be started, do its range here */
+	for (i = 1; i < nthreads; i++) {
+	    if (task[i].started) (void) pthread_join(task[i].thread, NULL);
+	    else (*fn)(arg, task[i].from, task[i].to);
+	}
+	return;
+    }
+#endif
+
+    (*fn)(arg, 0UL, n);
+}
+
 /*
  *  Utility function for file-writers: seek to a particular page
  */
 int
-_wri_seek_to_page(PN n, FILE *fp)
+_wri_seek_to_page(wri_doc_t *doc, PN n, FILE *fp)
 {
     long offset = (long)n * PAGESIZE;
 
     if (fseek(fp, offset, SEEK_SET) != 0) {
-	_wri_error = 1;
+	doc->error = 1;
 	return(1);
     }
 
@@ -109,26 +970,78 @@ _wri_seek_to_page(PN n, FILE *fp)
      * data, and the write fails, fseek returns success all the same.
      */
     if (ferror(fp)) {
-	_wri_error = 1;
+	doc->error = 1;
 	return(1);
     }
 
     return(0);
 }
 
+/*
+ *  The same functions, acting on the default document
+ */
 int
-_wri_write_page(char *page, FILE *ofp)
+wri_save(char *filename)
 {
-    if (fwrite(page, (size_t) PAGESIZE, (size_t) 1, ofp) != (size_t)1) {
-	_wri_error = 1;
-	return(1);
-    }
+    return(wri_save_r(_wri_default_doc(), filename));
+}
 
-    /* Defensive programming... */
-    if (ferror(ofp)) {
-	_wri_error = 1;
-	return(1);
-    }
+int
+wri_save_mem(void **bufp, size_t *lenp)
+{
+    return(wri_save_mem_r(_wri_default_doc(), bufp, lenp));
+}
 
-    return(0);
+int
+wri_save_sink(wri_write_fn write_fn, void *ctx)
+{
+    return(wri_save_sink_r(_wri_default_doc(), write_fn, ctx));
+}
+
+int
+wri_save_stream(FILE *ofp)
+{
+    return(wri_save_stream_r(_wri_default_doc(), ofp));
+}
+
+size_t
+wri_saved_size(void)
+{
+    return(wri_saved_size_r(_wri_default_doc()));
+}
+
+int
+wri_save_begin(char *filename)
+{
+    return(wri_save_begin_r(_wri_default_doc(), filename));
+}
+
+int
+wri_save_begin_sink(wri_write_fn write_fn, void *ctx)
+{
+    return(wri_save_begin_sink_r(_wri_default_doc(), write_fn, ctx));
+}
+
+int
+wri_save_step(unsigned long budget)
+{
+    return(wri_save_step_r(_wri_default_doc(), budget));
+}
+
+int
+wri_save_end(void)
+{
+    return(wri_save_end_r(_wri_default_doc()));
+}
+
+int
+wri_begin(char *filename)
+{
+    return(wri_begin_r(_wri_default_doc(), filename));
+}
+
+int
+wri_end(void)
+{
+    return(wri_end_r(_wri_default_doc()));
 }
@@ -20,7 +20,7 @@
 /*
  *  Default section info.
  */
-static const struct SEP default_sep = {
+const struct SEP _wri_default_sep = {
     sizeof(struct SEP)-1,   /* cch */
     0,	    /* res1 */
     15840,  /* yaMac */
@@ -36,22 +36,10 @@ static const struct SEP default_sep = {
 };
 
 /*
- *  Current section info, modifiable by the user
+ *  The current section info, modifiable by the user, is the document's
+ *  section.sep.  Its dyaText, dxaText and yaFooter are calculated from
+ *  section.dyaBottom, section.dxaRight and section.dyaFooter when we save.
  */
-struct SEP _wri_sep = {
-    sizeof(struct SEP)-1,   /* cch */
-    0,	    /* res1 */
-    15840,  /* yaMac */
-    12240,  /* xaMac */
-    0xFFFF, /* pgnFirst */
-    1440,   /* yaTop */
-    12960,  /* dyaText */	/* Calculated from dyaBottom when we save */
-    1800,   /* xaLeft */
-    8640,   /* dxaText */	/* Calculated from dxaRight when we save */
-    256,    /* res2 (empirically) */
-    1080,   /* yaHeader */
-    14760,  /* yaFooter */	/* Calculated from dyaFooter when we save */
-};
 
 /*
  * The user defines top, left, right and bottom margins, and the page size.
@@ -85,17 +73,11 @@ struct SEP _wri_sep = {
  *	    xaMac
  */
 
-static int dxaRight = 12240 - 1800 - 8640;  /* xaMac - xaLeft - dxaText */
-static int dyaBottom = 15840 - 1440 - 12960;/* yaMac - yaTop - dyaText */
-
-/* Footer is specified as distance from bottom, stored as distance from top */
-static int dyaFooter = 1080;	/* 0.75in */
-
 int
-wri_doc_number_from(int pgnFirst)
+wri_doc_number_from_r(wri_doc_t *doc, int pgnFirst)
 {
     if (pgnFirst >= 1 && pgnFirst <= 127) {
-	_wri_sep.pgnFirst = pgnFirst;
+	doc->section.sep.pgnFirst = pgnFirst;
 	return(0);
     }
     return(1);
@@ -110,54 +92,54 @@ wri_doc_number_from(int pgnFirst)
  */
 
 int
-wri_doc_margin_left(int margin)
+wri_doc_margin_left_r(wri_doc_t *doc, int margin)
 {
     if (margin >= 0 && margin <= 32767) {
-	_wri_sep.xaLeft = margin;
+	doc->section.sep.xaLeft = margin;
 	return(0);
     }
     return(1);
 }
 
 int
-wri_doc_margin_top(int margin)
+wri_doc_margin_top_r(wri_doc_t *doc, int margin)
 {
     if (margin >= 0 && margin <= 32767) {
-	_wri_sep.yaTop = margin;
+	doc->section.sep.yaTop = margin;
 	return(0);
     }
     return(1);
 }
 
 int
-wri_doc_margin_right(int margin)
+wri_doc_margin_right_r(wri_doc_t *doc, int margin)
 {
-    dxaRight = margin;
+    doc->section.dxaRight = margin;
     return(1);
 }
 
 int
-wri_doc_margin_bottom(int margin)
+wri_doc_margin_bottom_r(wri_doc_t *doc, int margin)
 {
-    dyaBottom = margin;
+    doc->section.dyaBottom = margin;
     return(1);
 }
 
 int
-wri_doc_page_width(int width)
+wri_doc_page_width_r(wri_doc_t *doc, int width)
 {
     if (width > 0 && width <= 32767) {
-	_wri_sep.xaMac = width;
+	doc->section.sep.xaMac = width;
 	return(0);
     }
     return(1);
 }
 
 int
-wri_doc_page_height(int height)
+wri_doc_page_height_r(wri_doc_t *doc, int height)
 {
     if (height > 0 && height <= 32767) {
-	_wri_sep.yaMac = height;
+	doc->section.sep.yaMac = height;
 	return(0);
     }
     return(1);
@@ -168,10 +150,10 @@ wri_doc_page_height(int height)
  */
 
 int
-wri_doc_distance_from_top(int distance)
+wri_doc_distance_from_top_r(wri_doc_t *doc, int distance)
 {
     if (distance >= 0 && distance <= 31680) {
-	_wri_sep.yaHeader = distance;
+	doc->section.sep.yaHeader = distance;
 	return(0);
     }
     return(1);
@@ -181,10 +163,10 @@ wri_doc_distance_from_top(int distance)
  * Specified as distance from bottom of page, stored as distance from top.
  */
 int
-wri_doc_distance_from_bottom(int distance)
+wri_doc_distance_from_bottom_r(wri_doc_t *doc, int distance)
 {
     if (distance >= 0 && distance <= 31680) {
-	dyaFooter = distance;
+	doc->section.dyaFooter = distance;
 	return(0);
     }
     return(1);
@@ -194,26 +176,34 @@ wri_doc_distance_from_bottom(int distance)
  * stored in the SEP, and vice-versa
  */
 void
-_wri_user_to_sep()
+_wri_user_to_sep(wri_doc_t *doc)
 {
-    _wri_sep.dxaText = _wri_sep.xaMac - _wri_sep.xaLeft - dxaRight;
-    _wri_sep.dyaText = _wri_sep.yaMac - _wri_sep.yaTop - dyaBottom;
+    struct section_state *sp = &doc->section;
+
+    sp->sep.dxaText = sp->sep.xaMac - sp->sep.xaLeft - sp->dxaRight;
+    sp->sep.dyaText = sp->sep.yaMac - sp->sep.yaTop - sp->dyaBottom;
 
     /* Footer is stored as distance from top, not distance from bottom */
-    _wri_sep.yaFooter = _wri_sep.yaMac - dyaFooter;
+    sp->sep.yaFooter = sp->sep.yaMac - sp->dyaFooter;
 }
 
 /* Called from read.c */
 void
-_wri_sep_to_user()
+_wri_sep_to_user(wri_doc_t *doc)
 {
-    dxaRight = _wri_sep.xaMac - _wri_sep.xaLeft - _wri_sep.dxaText;
-    dyaBottom = _wri_sep.yaMac - _wri_sep.yaTop - _wri_sep.dyaText;
-    dyaFooter = _wri_sep.yaMac - _wri_sep.yaFooter;
+    struct section_state *sp = &doc->section;
+
+    sp->dxaRight = sp->sep.xaMac - sp->sep.xaLeft - sp->sep.dxaText;
+    sp->dyaBottom = sp->sep.yaMac - sp->sep.yaTop - sp->sep.dyaText;
+    sp->dyaFooter = sp->sep.yaMac - sp->sep.yaFooter;
 }
 
+/*
+ * Encode the SEP and SETB into pages in <pb>, if the SEP is not the default.
+ * hp->pnSep must be set, and this sets hp->pnSetb and hp->pnPgtb.
+ */
 int
-_wri_save_section(struct wri_header *hp, FILE *ofp)
+_wri_save_section(wri_doc_t *doc, struct wri_header *hp, struct page_buf *pb)
 {
     char page[PAGESIZE];
     struct SETB setb;
@@ -221,9 +211,10 @@ _wri_save_section(struct wri_header *hp, FILE *ofp)
     /*
      * Fix calculation of distances according to final page size
      */
-    _wri_user_to_sep();
+    _wri_user_to_sep(doc);
 
-    if (memcmp(&_wri_sep, &default_sep, (size_t) sizeof(_wri_sep)) == 0) {
+    if (memcmp(&doc->section.sep, &_wri_default_sep,
+	       (size_t) sizeof(doc->section.sep)) == 0) {
 	/* Default SEP needs not be specified */
 	hp->pnPgtb = hp->pnSetb = hp->pnSep;
 	return(0);
@@ -241,9 +232,9 @@ _wri_save_section(struct wri_header *hp, FILE *ofp)
     (void*) memset(page, 0, PAGESIZE);
 
     /* Copy in SEP */
-    (void*) memcpy(page, &_wri_sep, sizeof(_wri_sep));
-    /* And write to file */
-    if (_wri_seek_to_page(hp->pnSep, ofp) || _wri_write_page(page, ofp)) {
+    (void*) memcpy(page, &doc->section.sep, sizeof(doc->section.sep));
+    /* And add to the pages */
+    if (_wri_add_page(pb, page)) {
 	/* Failed - so specify no section info */
 	hp->pnPgtb = hp->pnSetb = hp->pnSep;
 	return(1);
@@ -254,7 +245,7 @@ _wri_save_section(struct wri_header *hp, FILE *ofp)
      */
 
     /* Clear unused stuff to 0 */
-    (void*) memset(page, 0, sizeof(_wri_sep));
+    (void*) memset(page, 0, sizeof(doc->section.sep));
 
     /* Create SETB */
     setb.csed = 2;
@@ -264,7 +255,7 @@ _wri_save_section(struct wri_header *hp, FILE *ofp)
 
     /* Copy in SETB */
     (void*) memcpy(page, &setb, sizeof(setb));
-    if (_wri_seek_to_page(hp->pnSetb, ofp) || _wri_write_page(page, ofp)) {
+    if (_wri_add_page(pb, page)) {
 	/* Failed - so specify no section info */
 	hp->pnPgtb = hp->pnSetb = hp->pnSep;
 	return(1);
@@ -277,15 +268,72 @@ _wri_save_section(struct wri_header *hp, FILE *ofp)
  * Set back to default values for a new document
  */
 int
-_wri_reinit_section()
+_wri_reinit_section(wri_doc_t *doc)
 {
-    _wri_set_default_sep();
+    _wri_set_default_sep(doc);
     return(0);
 }
 
 void
-_wri_set_default_sep()
+_wri_set_default_sep(wri_doc_t *doc)
+{
+    memcpy(&doc->section.sep, &_wri_default_sep, sizeof(struct SEP));
+    _wri_sep_to_user(doc);
+}
+
+/*
+ *  The same functions, acting on the default document
+ */
+int
+wri_doc_number_from(int pgnFirst)
+{
+    return(wri_doc_number_from_r(_wri_default_doc(), pgnFirst));
+}
+
+int
+wri_doc_margin_left(int margin)
+{
+    return(wri_doc_margin_left_r(_wri_default_doc(), margin));
+}
+
+int
+wri_doc_margin_top(int margin)
+{
+    return(wri_doc_margin_top_r(_wri_default_doc(), margin));
+}
+
+int
+wri_doc_margin_right(int margin)
+{
+    return(wri_doc_margin_right_r(_wri_default_doc(), margin));
+}
+
+int
+wri_doc_margin_bottom(int margin)
+{
+    return(wri_doc_margin_bottom_r(_wri_default_doc(), margin));
+}
+
+int
+wri_doc_page_width(int width)
+{
+    return(wri_doc_page_width_r(_wri_default_doc(), width));
+}
+
+int
+wri_doc_page_height(int height)
+{
+    return(wri_doc_page_height_r(_wri_default_doc(), height));
+}
+
+int
+wri_doc_distance_from_top(int distance)
+{
+    return(wri_doc_distance_from_top_r(_wri_default_doc(), distance));
+}
+
+int
+wri_doc_distance_from_bottom(int distance)
 {
-    memcpy(&_wri_sep, &default_sep, sizeof(struct SEP));
-    _wri_sep_to_user();
+    return(wri_doc_distance_from_bottom_r(_wri_default_doc(), distance));
 }
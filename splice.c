@@ -0,0 +1,82 @@
+/*
+ *  Library to generate write files.
+ *
+ *  Code to splice document fragments together.
+ *
+ *  A fragment is simply a document created with wri_doc_create() and built
+ *  with the _r functions, maybe in another thread.  Splicing it onto the end
+ *  of a document moves its text there without copying it, if both are in
+ *  memory, and adds its CHP and PAP runs to the document's tables, looking
+ *  up each different CHP and PAP of the fragment just once.  The fragment
+ *  is then left empty, as after wri_new().
+ */
+#include <stdio.h>  /* for NULL */
+#include "libwrite.h"	/* Public definitions */
+#include "write.h"	/* Data structures for Write documents */
+#include "defs.h"	/* Definitions internal to the library */
+
+/*
+ *  Append the fragment <frag> to the document <doc>.
+ *  The fragment's section info and tabstops are not used: those of the
+ *  document apply.  If the fragment has a running header or footer, the
+ *  document must not have any normal text yet.
+ */
+int
+wri_splice_r(wri_doc_t *doc, wri_doc_t *frag)
+{
+    int font_map[MAX_FONTS];	/* Font codes of frag -> font codes of doc */
+    CP offset;	/* Where the fragment's text will start in the document */
+    int rhc;	/* Does the fragment have running head paragraphs? */
+    int i;
+
+    if (frag == NULL || frag == doc || frag->error) return(1);
+
+    /* Neither can be in the middle of a running head */
+    if (doc->text.in_rhc || frag->text.in_rhc) return(1);
+
+    rhc = _wri_has_rhc(frag);
+    if (rhc && doc->text.had_normal_text) return(1);
+
+    /* Translate the fragment's font codes.  If we fail later, the new fonts
+     * don't do any harm. */
+    for (i = 0; i < frag->font.NFontsUsed; i++) {
+	font_map[i] = _wri_cvt_font_name_to_code(doc,
+			frag->font.ffntb[i].font_name, frag->font.ffntb[i].ffid);
+	if (font_map[i] == -1) return(1);
+    }
+
+    offset = doc->text.cpMac;
+
+    /* The text goes last because once it has been moved it cannot be
+     * put back. */
+    _wri_breakpoint_pap(doc);
+    _wri_breakpoint_text(doc);
+    _wri_breakpoint_chp(doc);
+
+    if (_wri_splice_pap(doc, frag, offset, NULL) ||
+	_wri_splice_chp(doc, frag, offset, font_map, NULL) ||
+	_wri_splice_text(doc, frag)) {
+	_wri_rollback_text(doc);
+	_wri_rollback_chp(doc);
+	_wri_rollback_pap(doc);
+	return(1);
+    }
+
+    /* Print the fragment's header or footer on the first page if it says so */
+    if (rhc) {
+	if (frag->pap.pofp[0]) doc->pap.pofp[0] = 1;
+	if (frag->pap.pofp[1]) doc->pap.pofp[1] = 1;
+    }
+
+    /* Forget what's left of the fragment, ready for reuse */
+    return(wri_new_r(frag));
+}
+
+/*
+ *  The same function, acting on the default document
+ */
+int
+wri_splice(wri_doc_t *frag)
+{
+    return(wri_splice_r(_wri_default_doc(), frag));
+}
@@ -0,0 +1,396 @@
+/*
+ *  Library to generate write files.
+ *
+ *  Templates: Write files that are read once and inserted many times.
+ *
+ *  A template is a document of its own into which the file is read, with
+ *  all its text in memory and its current CHP put in the table, as for a
+ *  save.  After that it is never changed, so inserting it into a document
+ *  only has to add its runs, with their character positions and style
+ *  numbers translated, and copy its text; and any number of threads can
+ *  insert the same template at once.
+ *
+ *  A template can also be used for a mail merge.  When it is loaded, its
+ *  text is searched for fields like {{name}}, and wri_template_merge()
+ *  copies the text around them and puts a value of the caller's in place
+ *  of each one; the runs of the template are moved along by the difference
+ *  in length as they are added, so nothing is searched for again.
+ */
+#include <stdio.h>  /* for NULL */
+#include <stdlib.h> /* for malloc() */
+#include <string.h> /* for strlen() */
+#include <limits.h> /* for LONG_MAX */
+#include "libwrite.h"	/* Public definitions */
+#include "write.h"	/* Data structures for Write documents */
+#include "defs.h"	/* Definitions internal to the library */
+
+struct wri_template {
+    wri_doc_t *doc;	/* The document read from the file */
+    char *text;		/* A copy of its text in one piece */
+    unsigned long nfields;	/* How many {{fields}} there are in it */
+    CP *first, *lim;	/* Where each one starts and ends, braces included */
+    char **name;	/* and what it is called */
+    char *names;	/* Space for the names */
+};
+
+static wri_template_t *new_template(void);
+static wri_template_t *finish_template(wri_template_t *tpl, int failed);
+static int find_fields(wri_template_t *tpl);
+static int next_field(char *text, CP len, CP from, CP *firstp, CP *limp);
+static void free_fields(wri_template_t *tpl);
+
+/*
+ *  Read a Write file as a template.  Returns NULL if it can't be read.
+ */
+wri_template_t *
+wri_template_load(char *filename)
+{
+    wri_template_t *tpl = new_template();
+
+    if (tpl == NULL) return(NULL);
+    return(finish_template(tpl, wri_read_r(tpl->doc, filename, WRI_ALL)));
+}
+
+/* The same, from a Write file in memory */
+wri_template_t *
+wri_template_load_mem(const void *buf, size_t len)
+{
+    wri_template_t *tpl = new_template();
+
+    if (tpl == NULL) return(NULL);
+    return(finish_template(tpl, wri_read_mem_r(tpl->doc, buf, len, WRI_ALL)));
+}
+
+void
+wri_template_free(wri_template_t *tpl)
+{
+    if (tpl == NULL) return;
+    free_fields(tpl);
+    wri_doc_destroy(tpl->doc);
+    free((char *) tpl);
+}
+
+/*
+ *  Insert a template at the end of the document, as wri_read() would insert
+ *  the file it was loaded from.  <what> is as for wri_read().
+ */
+int
+wri_template_insert_r(wri_doc_t *doc, const wri_template_t *tpl, int what)
+{
+    wri_doc_t *frag = tpl->doc;	/* Only read, never changed */
+    int font_map[MAX_FONTS];	/* Font codes of frag -> font codes of doc */
+    CP offset = doc->text.cpMac;	/* Where its text will start */
+    int i;
+
+    if (doc->text.in_rhc) return(1);
+
+    /* Translate the template's font codes.  As with wri_read(), the new
+     * fonts do no harm if we fail later. */
+    if (what & WRI_CHAR_INFO) {
+	for (i = 0; i < frag->font.NFontsUsed; i++) {
+	    font_map[i] = _wri_cvt_font_name_to_code(doc,
+			frag->font.ffntb[i].font_name, frag->font.ffntb[i].ffid);
+	    if (font_map[i] == -1) return(1);
+	}
+    }
+
+    _wri_breakpoint_pap(doc);
+    _wri_breakpoint_text(doc);
+    _wri_breakpoint_chp(doc);
+
+    if (what & (WRI_TEXT | WRI_PARA_INFO)) {
+	if (_wri_splice_pap(doc, frag, offset, NULL)) goto rollback;
+
+	if ((what & WRI_TEXT) && _wri_copy_text(doc, frag)) goto rollback;
+
+	if (what & WRI_CHAR_INFO) {
+	    if (_wri_splice_chp(doc, frag, offset, font_map, NULL))
+		goto rollback;
+	} else {
+	    _wri_extend_chp(doc, offset + frag->text.cpMac);
+	}
+    }
+
+    if (what & WRI_TABS) _wri_set_tabs(doc, frag->pap.tbd);
+
+    if (what & WRI_DOCUMENT) doc->section = frag->section;
+
+    return(0);
+
+rollback:
+    _wri_rollback_text(doc);
+    _wri_rollback_chp(doc);
+    _wri_rollback_pap(doc);
+    return(1);
+}
+
+/*
+ *  Insert a template at the end of the document as wri_template_insert()
+ *  does, replacing each of its fields with the string that <field_fn>
+ *  returns for the field's name, which takes the character properties of
+ *  the field's first brace.  If <field_fn> returns NULL, the field is left
+ *  as it is.  A value must not contain control characters other than tab.
+ */
+int
+wri_template_merge_r(wri_doc_t *doc, const wri_template_t *tpl, int what,
+		     wri_field_fn field_fn, void *ctx)
+{
+    wri_doc_t *frag = tpl->doc;	/* Only read, never changed */
+    int font_map[MAX_FONTS];	/* Font codes of frag -> font codes of doc */
+    CP offset = doc->text.cpMac;	/* Where its text will start */
+    struct cp_shift shift;	/* Where its fields' values go */
+    CP from;			/* Start of the text after the last field */
+    const char *value;
+    const char *p;
+    unsigned long n;
+    int i;
+
+    if (doc->text.in_rhc || field_fn == NULL) return(1);
+
+    if (tpl->nfields == 0) return(wri_template_insert_r(doc, tpl, what));
+
+    shift.n = tpl->nfields;
+    shift.first = tpl->first;
+    shift.lim = tpl->lim;
+    shift.len = (CP *) malloc(2 * tpl->nfields * sizeof(CP) + tpl->nfields);
+    if (shift.len == NULL) return(1);
+    shift.to = shift.len + tpl->nfields;
+    shift.kept = (char *) (shift.to + tpl->nfields);
+
+    if (what & WRI_CHAR_INFO) {
+	for (i = 0; i < frag->font.NFontsUsed; i++) {
+	    font_map[i] = _wri_cvt_font_name_to_code(doc,
+			frag->font.ffntb[i].font_name, frag->font.ffntb[i].ffid);
+	    if (font_map[i] == -1) goto fail;
+	}
+    }
+
+    _wri_breakpoint_pap(doc);
+    _wri_breakpoint_text(doc);
+    _wri_breakpoint_chp(doc);
+
+    /* The text goes first, so that each value is used as soon as we have
+     * it: the caller can return them all in the same buffer. */
+    from = 0;
+    for (n = 0; n < tpl->nfields; n++) {
+	shift.to[n] = (n == 0) ? tpl->first[0] :
+	    shift.to[n-1] + shift.len[n-1] + (tpl->first[n] - tpl->lim[n-1]);
+
+	value = (*field_fn)(ctx, tpl->name[n]);
+	shift.kept[n] = (value == NULL);
+	if (value == NULL) {
+	    value = tpl->text + tpl->first[n];
+	    shift.len[n] = tpl->lim[n] - tpl->first[n];
+	} else {
+	    for (p = value; *p != '\0'; p++) {
+		if ((unsigned char) *p < ' ' && *p != '\t') goto rollback;
+	    }
+	    shift.len[n] = p - value;
+	}
+
+	if ((what & WRI_TEXT) &&
+	    (_wri_append_text_mem(doc, tpl->text + from,
+				  tpl->first[n] - from) ||
+	     _wri_append_text_mem(doc, (char *) value, shift.len[n])))
+	    goto rollback;
+	from = tpl->lim[n];
+    }
+    if ((what & WRI_TEXT) &&
+	_wri_append_text_mem(doc, tpl->text + from, frag->text.cpMac - from))
+	goto rollback;
+
+    if (what & (WRI_TEXT | WRI_PARA_INFO)) {
+	if (_wri_splice_pap(doc, frag, offset, &shift)) goto rollback;
+
+	if (what & WRI_CHAR_INFO) {
+	    if (_wri_splice_chp(doc, frag, offset, font_map, &shift))
+		goto rollback;
+	} else {
+	    _wri_extend_chp(doc,
+			offset + _wri_shift_cp(&shift, frag->text.cpMac));
+	}
+    }
+
+    if (what & WRI_TABS) _wri_set_tabs(doc, frag->pap.tbd);
+
+    if (what & WRI_DOCUMENT) doc->section = frag->section;
+
+    free((char *) shift.len);
+    return(0);
+
+rollback:
+    _wri_rollback_text(doc);
+    _wri_rollback_chp(doc);
+    _wri_rollback_pap(doc);
+fail:
+    free((char *) shift.len);
+    return(1);
+}
+
+/*
+ *  The name of the <n>th field of a template, counting from 0, or NULL if
+ *  it has fewer fields than that.
+ */
+const char *
+wri_template_field(const wri_template_t *tpl, unsigned long n)
+{
+    return(n < tpl->nfields ? tpl->name[n] : NULL);
+}
+
+/*
+ * Where character position <cp> of a template ends up when its fields are
+ * replaced as <sp> says.  A position inside a replaced field goes to the
+ * end of its value.  If <sp> is NULL, nothing moves.
+ */
+CP
+_wri_shift_cp(struct cp_shift *sp, CP cp)
+{
+    unsigned long lo, hi, mid;
+
+    if (sp == NULL) return(cp);
+
+    /* Find the last field that starts before cp */
+    lo = 0; hi = sp->n;
+    while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (sp->first[mid] < cp) lo = mid + 1;
+	else hi = mid;
+    }
+    if (lo == 0) return(cp);
+    lo--;
+
+    if (cp < sp->lim[lo] && !sp->kept[lo]) return(sp->to[lo] + sp->len[lo]);
+    return(sp->to[lo] + sp->len[lo] + (cp - sp->lim[lo]));
+}
+
+/* Make an empty template, which holds any amount of text in memory */
+static wri_template_t *
+new_template(void)
+{
+    wri_template_t *tpl;
+
+    tpl = (wri_template_t *) malloc(sizeof(wri_template_t));
+    if (tpl == NULL) return(NULL);
+
+    tpl->doc = wri_doc_create();
+    if (tpl->doc == NULL) {
+	free((char *) tpl);
+	return(NULL);
+    }
+    (void) wri_text_memory_r(tpl->doc, LONG_MAX);
+    tpl->text = tpl->names = NULL;
+    tpl->first = tpl->lim = NULL;
+    tpl->name = NULL;
+    tpl->nfields = 0;
+
+    return(tpl);
+}
+
+/*
+ * Once the file has been read, put the current CHP in the table, so that
+ * _wri_splice_chp() finds nothing to do to the template, and find its fields.
+ */
+static wri_template_t *
+finish_template(wri_template_t *tpl, int failed)
+{
+    if (failed || _wri_finish_chp(tpl->doc) || find_fields(tpl)) {
+	wri_template_free(tpl);
+	return(NULL);
+    }
+
+    return(tpl);
+}
+
+/*
+ * Make the copy of the template's text and index the fields in it.
+ * It is searched twice: once to count the fields and once to note them.
+ */
+static int
+find_fields(wri_template_t *tpl)
+{
+    CP len = tpl->doc->text.cpMac;
+    CP from, first, lim;
+    unsigned long n;
+    char *np;
+
+    tpl->text = malloc(len + 1);
+    if (tpl->text == NULL || _wri_get_text(tpl->doc, tpl->text)) return(1);
+
+    for (from = 0; next_field(tpl->text, len, from, &first, &lim); from = lim)
+	tpl->nfields++;
+    if (tpl->nfields == 0) return(0);
+
+    tpl->first = (CP *) malloc(2 * tpl->nfields * sizeof(CP));
+    tpl->name = (char **) malloc(tpl->nfields * sizeof(char *));
+    tpl->names = malloc(len + 1);
+    if (tpl->first == NULL || tpl->name == NULL || tpl->names == NULL)
+	return(1);
+    tpl->lim = tpl->first + tpl->nfields;
+
+    np = tpl->names;
+    from = 0;
+    for (n = 0; n < tpl->nfields; n++) {
+	(void) next_field(tpl->text, len, from, &first, &lim);
+	tpl->first[n] = first;
+	tpl->lim[n] = lim;
+	tpl->name[n] = np;
+	memcpy(np, tpl->text + first + 2, (size_t) (lim - first - 4));
+	np += lim - first - 4;
+	*np++ = '\0';
+	from = lim;
+    }
+
+    return(0);
+}
+
+/*
+ * Find the next field in <text> at or after <from>: {{ followed by a name
+ * on one line, without braces, and }}.  Returns 0 if there isn't one.
+ */
+static int
+next_field(char *text, CP len, CP from, CP *firstp, CP *limp)
+{
+    CP cp, end;
+
+    for (cp = from; cp + 4 < len; cp++) {
+	if (text[cp] != '{' || text[cp+1] != '{') continue;
+
+	for (end = cp + 2; end < len; end++) {
+	    if (text[end] == '{' || text[end] == '}' ||
+		(unsigned char) text[end] < ' ') break;
+	}
+	if (end > cp + 2 && end + 1 < len &&
+	    text[end] == '}' && text[end+1] == '}') {
+	    *firstp = cp;
+	    *limp = end + 2;
+	    return(1);
+	}
+    }
+
+    return(0);
+}
+
+static void
+free_fields(wri_template_t *tpl)
+{
+    if (tpl->text != NULL) free(tpl->text);
+    if (tpl->first != NULL) free((char *) tpl->first);
+    if (tpl->name != NULL) free((char *) tpl->name);
+    if (tpl->names != NULL) free(tpl->names);
+}
+
+/*
+ *  The same functions, acting on the default document
+ */
+int
+wri_template_insert(const wri_template_t *tpl, int what)
+{
+    return(wri_template_insert_r(_wri_default_doc(), tpl, what));
+}
+
+int
+wri_template_merge(const wri_template_t *tpl, int what,
+		   wri_field_fn field_fn, void *ctx)
+{
+    return(wri_template_merge_r(_wri_default_doc(), tpl, what, field_fn, ctx));
+}
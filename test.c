@@ -0,0 +1,561 @@
+/*
+ *  Library to generate write files.
+ *
+ *  Regression tests, run by "make check".  Each test returns 0 if it passes;
+ *  one that crashes fails the lot.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "libwrite.h"
+#include "write.h"
+
+/* The text of a document and the style of each character, from wri_scan */
+struct styled {
+    char text[256];
+    char style[256];	/* Each is a digit: 1 bold + 2 italic + 4 underlined */
+    size_t len;
+};
+
+/* A record of the calls that wri_scan made */
+struct scan_log {
+    char text[512];
+    size_t len;
+};
+
+/* A growing buffer that a save can write to */
+struct mem_out {
+    char *buf;
+    size_t len;
+};
+
+static int read_after_begin(void);
+static int read_bad_fkp(void);
+static int read_bad_fonts(void);
+static int ignore_font(void *ctx, int ftc, const char *name, int ffid);
+static int read_unknown_font(void);
+static int save_huge_step(void);
+static int append(void *ctx, const char *buf, size_t len);
+static int template_insert(void);
+static wri_template_t *make_template(void **bufp, size_t *lenp);
+static int template_merge(void);
+static const char *field_value(void *ctx, const char *name);
+static int scan_styled(struct styled *sp);
+static int collect_text(void *ctx, const char *text, size_t len,
+			const struct wri_char_info *cip);
+static int scan(void);
+static int log_line(struct scan_log *lp, const char *line);
+static int log_font(void *ctx, int font, const char *name, int family);
+static int log_section(void *ctx, const struct wri_section_info *sip);
+static int log_tabs(void *ctx, int ntabs, const struct wri_tab *tabs);
+static int log_para(void *ctx, const struct wri_para_info *pip);
+static int log_text(void *ctx, const char *text, size_t len,
+		    const struct wri_char_info *cip);
+
+int
+main()
+{
+    int failed = 0;
+
+    if (read_after_begin()) {
+	printf("FAIL: failing wri_read after wri_begin\n");
+	failed = 1;
+    }
+
+    if (read_bad_fkp()) {
+	printf("FAIL: reading a page of CHPs or PAPs with too many FODs\n");
+	failed = 1;
+    }
+
+    if (read_bad_fonts()) {
+	printf("FAIL: reading a page of fonts with an unterminated name\n");
+	failed = 1;
+    }
+
+    if (read_unknown_font()) {
+	printf("FAIL: reading a CHP whose font isn't in the font table\n");
+	failed = 1;
+    }
+
+    if (save_huge_step()) {
+	printf("FAIL: saving with a huge budget after smaller steps\n");
+	failed = 1;
+    }
+
+    if (template_insert()) {
+	printf("FAIL: inserting a template\n");
+	failed = 1;
+    }
+
+    if (template_merge()) {
+	printf("FAIL: merging a template\n");
+	failed = 1;
+    }
+
+    if (scan()) {
+	printf("FAIL: scanning a file\n");
+	failed = 1;
+    }
+
+    if (!failed) printf("All tests passed\n");
+    return(failed);
+}
+
+/*
+ * A wri_read() that fails right after wri_begin(), when the document has no
+ * text buffer yet, must leave the document as it was.
+ */
+static int
+read_after_begin(void)
+{
+    void *buf;
+    size_t len;
+    FILE *fp;
+    int result = 0;
+
+    /* A file whose header claims five more bytes of text than it has */
+    if (wri_new() || wri_text("Hello\n") || wri_save_mem(&buf, &len))
+	return(1);
+    ((struct wri_header *) buf)->fcMac += 5;
+    fp = fopen("test_bad.wri", "wb");
+    if (fp == NULL || fwrite(buf, 1, len, fp) != len || fclose(fp) != 0)
+	return(1);
+
+    if (wri_begin("test_out.wri") ||
+	wri_read_mem(buf, len, WRI_ALL) == 0 ||
+	wri_read("test_bad.wri", WRI_ALL) == 0 ||
+	wri_text("After\n") || wri_end()) {
+	result = 1;
+    }
+
+    free(buf);
+    remove("test_bad.wri");
+    remove("test_out.wri");
+    return(result);
+}
+
+/*
+ * A page of CHPs or PAPs that claims to have more FODs than fit in it must
+ * be rejected, not decoded past its end.
+ */
+static int
+read_bad_fkp(void)
+{
+    void *buf;
+    size_t len;
+    struct wri_header *hp;
+    int result = 0;
+    int i;
+
+    if (wri_new() || wri_text("Hello\n") || wri_save_mem(&buf, &len))
+	return(1);
+    hp = (struct wri_header *) buf;
+
+    /* The CHP page, then the PAP page; cfod is the last byte of each */
+    for (i = 0; i < 2; i++) {
+	char *cfodp = (char *) buf + (i == 0 ? pnChar(*hp) : hp->pnPara) *
+		      PAGESIZE + PAGESIZE - 1;
+	char was = *cfodp;
+
+	*cfodp = (char) 255;
+	if (wri_new() || wri_read_mem(buf, len, WRI_ALL) == 0) result = 1;
+	*cfodp = was;
+    }
+
+    free(buf);
+    return(result);
+}
+
+/*
+ * A font name that runs off the end of its page must be rejected, not read
+ * past the end of it.
+ */
+static int
+read_bad_fonts(void)
+{
+    void *buf;
+    size_t len;
+    struct wri_header *hp;
+    struct wri_scan_fns fns;
+    int result = 0;
+
+    if (wri_new() || wri_text("Hello\n") || wri_save_mem(&buf, &len))
+	return(1);
+    hp = (struct wri_header *) buf;
+
+    /* Keep cffn, then fill the rest of the page with non-nul bytes */
+    memset((char *) buf + hp->pnFfntb * PAGESIZE + 2, 'A', PAGESIZE - 2);
+
+    memset(&fns, 0, sizeof(fns));
+    fns.font = ignore_font;
+    if (wri_new() || wri_read_mem(buf, len, WRI_ALL) == 0 ||
+	wri_scan_mem(buf, len, &fns, NULL) == 0) {
+	result = 1;
+    }
+
+    free(buf);
+    return(result);
+}
+
+/*
+ * A CHP with a font code beyond the end of the file's font table must be
+ * rejected, not mapped through a part of the font map that was never set.
+ */
+static int
+read_unknown_font(void)
+{
+    void *buf;
+    size_t len;
+    struct wri_header *hp;
+    char *ffn;
+    int result = 0;
+
+    if (wri_new() || wri_text("Hello ") || wri_char_font_name("Courier") ||
+	wri_text("world\n") || wri_save_mem(&buf, &len)) {
+	return(1);
+    }
+    hp = (struct wri_header *) buf;
+
+    /* End the font table after its first font, which the CHPs don't use */
+    ffn = (char *) buf + hp->pnFfntb * PAGESIZE + 2;
+    ffn += 3 + strlen(ffn + 3) + 1;
+    ffn[0] = ffn[1] = '\0';
+
+    if (wri_new() || wri_read_mem(buf, len, WRI_ALL) == 0) result = 1;
+
+    free(buf);
+    return(result);
+}
+
+static int
+ignore_font(void *ctx, int ftc, const char *name, int ffid)
+{
+    return(0);
+}
+
+/*
+ * A wri_save_step() with a budget too big to turn into bytes or to add to
+ * the pages already written must finish the file, and leave it the same as
+ * saving in one go.
+ */
+static int
+save_huge_step(void)
+{
+    /* The second is a budget whose size in bytes wraps round to 0 */
+    static const unsigned long huge[] = { ULONG_MAX, (ULONG_MAX >> 7) + 1 };
+    /* These take us into the text, then into the pages after it */
+    static const int nsmall[] = { 2, 12 };
+    void *buf;
+    size_t len;
+    int result = 0;
+    int i, j, k;
+
+    /* 8 pages of text and, with a run per word, several pages of CHPs */
+    if (wri_new()) return(1);
+    for (i = 0; i < 200; i++) {
+	if (wri_char_bold(i & 1) || wri_text(i % 10 == 9 ? "word\n" : "word "))
+	    return(1);
+    }
+    if (wri_save_mem(&buf, &len)) return(1);
+
+    for (i = 0; i < 2; i++) {
+	for (j = 0; j < 2; j++) {
+	    struct mem_out out;
+
+	    out.buf = NULL;
+	    out.len = 0;
+	    if (wri_save_begin_sink(append, &out)) result = 1;
+	    for (k = 0; k < nsmall[j]; k++) {
+		if (wri_save_step(1UL) != WRI_SAVE_MORE) result = 1;
+	    }
+	    if (wri_save_step(huge[i]) != WRI_SAVE_DONE) result = 1;
+	    if (wri_save_end()) result = 1;
+
+	    if (out.len != len || memcmp(out.buf, buf, len) != 0) result = 1;
+	    free(out.buf);
+	}
+    }
+
+    free(buf);
+    return(result);
+}
+
+static int
+append(void *ctx, const char *buf, size_t len)
+{
+    struct mem_out *mp = (struct mem_out *) ctx;
+    char *new;
+
+    new = realloc(mp->buf, mp->len + len);
+    if (new == NULL) return(1);
+    memcpy(new + mp->len, buf, len);
+    mp->buf = new;
+    mp->len += len;
+    return(0);
+}
+
+/*
+ * Inserting a template must give the same file as reading the file it was
+ * loaded from, and it must find the template's fields.
+ */
+static int
+template_insert(void)
+{
+    static const char *names[] = { "name", "thing", "empty", "sig" };
+    wri_template_t *tpl;
+    void *src, *read_buf, *insert_buf;
+    size_t src_len, read_len, insert_len;
+    int result = 0;
+    int i;
+
+    if ((tpl = make_template(&src, &src_len)) == NULL) return(1);
+
+    for (i = 0; i < 4; i++) {
+	const char *name = wri_template_field(tpl, (unsigned long) i);
+
+	if (name == NULL || strcmp(name, names[i]) != 0) result = 1;
+    }
+    if (wri_template_field(tpl, 4UL) != NULL) result = 1;
+
+    /* Twice each, after some text of another style */
+    if (wri_new() || wri_char_bold(1) || wri_text("Top\n") ||
+	wri_read_mem(src, src_len, WRI_ALL) ||
+	wri_read_mem(src, src_len, WRI_ALL) ||
+	wri_save_mem(&read_buf, &read_len)) {
+	return(1);
+    }
+    if (wri_new() || wri_char_bold(1) || wri_text("Top\n") ||
+	wri_template_insert(tpl, WRI_ALL) ||
+	wri_template_insert(tpl, WRI_ALL) ||
+	wri_save_mem(&insert_buf, &insert_len)) {
+	return(1);
+    }
+    if (insert_len != read_len || memcmp(insert_buf, read_buf, read_len) != 0)
+	result = 1;
+
+    free(src);
+    free(read_buf);
+    free(insert_buf);
+    wri_template_free(tpl);
+    return(result);
+}
+
+/*
+ * Make a template with four fields, "name", "thing", "empty" and "sig",
+ * whose braces and names are in different styles.  The last is at the very
+ * end of its text.  The file it was loaded from is returned in *bufp.
+ */
+static wri_template_t *
+make_template(void **bufp, size_t *lenp)
+{
+    wri_template_t *tpl;
+
+    if (wri_new() || wri_text("Dear ") ||
+	wri_char_bold(1) || wri_text("{{") || wri_char_bold(0) ||
+	wri_char_italic(1) || wri_text("name") || wri_char_italic(0) ||
+	wri_text("}}, your {{") ||
+	wri_char_underline(1) || wri_text("thing") || wri_char_underline(0) ||
+	wri_text("}} is{{empty}} ready.\nFrom {{") ||
+	wri_char_italic(1) || wri_text("sig") ||
+	wri_char_underline(1) || wri_text("}}") ||
+	wri_save_mem(bufp, lenp)) {
+	return(NULL);
+    }
+    if ((tpl = wri_template_load_mem(*bufp, *lenp)) == NULL) free(*bufp);
+    return(tpl);
+}
+
+/*
+ * Merging a template must put each value in the style of its field's first
+ * brace, whatever styles the rest of the field had, leave a field whose value
+ * is NULL as it was, and leave the document in the style of the last value
+ * when that was at the end of the template.
+ */
+static int
+template_merge(void)
+{
+    static const char text[] =
+	"Dear " "Professor Smith" ", your {{" "thing"
+	"}} is ready.\r\nFrom Jo x\r\n";
+    static const char style[] =
+	"00000" "111111111111111" "000000000" "44444"
+	"0000000000000000000000000";
+    wri_template_t *tpl;
+    void *src;
+    size_t src_len;
+    struct styled out;
+    int result = 0;
+
+    if ((tpl = make_template(&src, &src_len)) == NULL) return(1);
+
+    if (wri_new() || wri_template_merge(tpl, WRI_ALL, field_value, NULL) ||
+	wri_text(" x\n") || scan_styled(&out)) {
+	result = 1;
+    } else if (strcmp(out.text, text) != 0 || strcmp(out.style, style) != 0) {
+	result = 1;
+    }
+
+    free(src);
+    wri_template_free(tpl);
+    return(result);
+}
+
+/* Values for make_template()'s fields: longer, NULL, empty and shorter */
+static const char *
+field_value(void *ctx, const char *name)
+{
+    if (strcmp(name, "name") == 0) return("Professor Smith");
+    if (strcmp(name, "empty") == 0) return("");
+    if (strcmp(name, "sig") == 0) return("Jo");
+    return(NULL);
+}
+
+/* Save the current document and get its text and styles back */
+static int
+scan_styled(struct styled *sp)
+{
+    void *buf;
+    size_t len;
+    struct wri_scan_fns fns;
+    int result;
+
+    if (wri_save_mem(&buf, &len)) return(1);
+
+    memset(&fns, 0, sizeof(fns));
+    fns.text = collect_text;
+    sp->len = 0;
+    sp->text[0] = sp->style[0] = '\0';
+    result = wri_scan_mem(buf, len, &fns, (void *) sp);
+
+    free(buf);
+    return(result);
+}
+
+static int
+collect_text(void *ctx, const char *text, size_t len,
+	     const struct wri_char_info *cip)
+{
+    struct styled *sp = (struct styled *) ctx;
+    int style = '0' + (cip->bold ? 1 : 0) + (cip->italic ? 2 : 0) +
+		(cip->underline ? 4 : 0);
+
+    if (sp->len + len >= sizeof(sp->text)) return(1);
+    memcpy(sp->text + sp->len, text, len);
+    memset(sp->style + sp->len, style, len);
+    sp->len += len;
+    sp->text[sp->len] = sp->style[sp->len] = '\0';
+    return(0);
+}
+
+/*
+ * wri_scan must call each function with what the document was made with,
+ * in the documented order.
+ */
+static int
+scan(void)
+{
+    static const char expected[] =
+	"font 0 Arial\n"
+	"font 1 Courier\n"
+	"section left 2000\n"
+	"tabs 1440\n"
+	"para justify 1 indent 0\n"
+	"text 1 14 b [Title\r\n]\n"
+	"para justify 0 indent 720\n"
+	"text 1 14 - [Body\ttext\r\n]\n";
+    void *buf;
+    size_t len;
+    struct wri_scan_fns fns;
+    struct scan_log log;
+    int result = 0;
+
+    if (wri_new() || wri_doc_margin_left(2000) ||
+	wri_doc_tab_set(1440, 0) || wri_para_justify(WRI_CENTER) ||
+	wri_char_font_name("Courier") || wri_char_font_size(14) ||
+	wri_char_bold(1) || wri_text("Title\n") ||
+	wri_para_normal() || wri_para_indent_left(720) ||
+	wri_char_normal() || wri_text("Body\ttext\n") ||
+	wri_save_mem(&buf, &len)) {
+	return(1);
+    }
+
+    fns.font = log_font;
+    fns.section = log_section;
+    fns.tabs = log_tabs;
+    fns.para = log_para;
+    fns.text = log_text;
+    log.len = 0;
+    log.text[0] = '\0';
+    if (wri_scan_mem(buf, len, &fns, (void *) &log) ||
+	strcmp(log.text, expected) != 0) {
+	result = 1;
+    }
+
+    free(buf);
+    return(result);
+}
+
+static int
+log_line(struct scan_log *lp, const char *line)
+{
+    size_t len = strlen(line);
+
+    if (lp->len + len >= sizeof(lp->text)) return(1);
+    memcpy(lp->text + lp->len, line, len + 1);
+    lp->len += len;
+    return(0);
+}
+
+static int
+log_font(void *ctx, int font, const char *name, int family)
+{
+    char line[80];
+
+    sprintf(line, "font %d %.60s\n", font, name);
+    return(log_line((struct scan_log *) ctx, line));
+}
+
+static int
+log_section(void *ctx, const struct wri_section_info *sip)
+{
+    char line[80];
+
+    sprintf(line, "section left %d\n", sip->margin_left);
+    return(log_line((struct scan_log *) ctx, line));
+}
+
+static int
+log_tabs(void *ctx, int ntabs, const struct wri_tab *tabs)
+{
+    char line[80];
+    int i;
+
+    strcpy(line, "tabs");
+    for (i = 0; i < ntabs && i < 8; i++) {
+	sprintf(line + strlen(line), " %d", tabs[i].position);
+    }
+    strcat(line, "\n");
+    return(log_line((struct scan_log *) ctx, line));
+}
+
+static int
+log_para(void *ctx, const struct wri_para_info *pip)
+{
+    char line[80];
+
+    sprintf(line, "para justify %d indent %d\n",
+	    pip->justify, pip->indent_left);
+    return(log_line((struct scan_log *) ctx, line));
+}
+
+static int
+log_text(void *ctx, const char *text, size_t len,
+	 const struct wri_char_info *cip)
+{
+    char line[80];
+
+    sprintf(line, "text %d %d %s [%.*s]\n", cip->font, cip->font_size,
+	    cip->bold ? "b" : "-", len > 40 ? 40 : (int) len, text);
+    return(log_line((struct scan_log *) ctx, line));
+}
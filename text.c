@@ -6,7 +6,7 @@
  *		Append text with current properties
  *		Add hard page breaks and other special characters
  *	Private data:
- *		list of CHPs defined for the text so far
+ *		the text of the document so far, in doc->text
  *	Query:
  *		What is the precise list of valid characters for output?
  *		When should we generate a new PAP in response to funny characters
@@ -14,9 +14,23 @@
  *
  *	Copyright 1992 Martin Guy, Via Marzabotto 3, 47036 Riccione - FO, Italy.
  */
+#if defined(__linux__)
+# define _GNU_SOURCE	/* for copy_file_range() */
+#endif
 #include <stdio.h>	/* for NULL */
 #include <stdlib.h>	/* for exit() */
-#include <string.h>	/* for strchr() */
+#include <string.h>	/* for memchr() */
+#if defined(__linux__)
+# include <errno.h>	/* for errno */
+# include <unistd.h>	/* for copy_file_range() and lseek() */
+# include <sys/sendfile.h>	/* for sendfile() */
+# include <sys/uio.h>	/* for pwritev() */
+#endif
+#if defined(__AVX2__)
+# include <immintrin.h>	/* for AVX2 intrinsics */
+#elif defined(__SSE2__)
+# include <emmintrin.h>	/* for SSE2 intrinsics */
+#endif
 
 #include "libwrite.h"	/* Public definitions */
 #include "write.h"	/* Data structures for Write documents */
@@ -25,86 +39,139 @@
 /*
  *	Function prototypes
  */
-static int do_text(char *text);
-static int create_tempfile(void);
+static int do_text(wri_doc_t *doc, const char *text, size_t len);
+static const char *find_special(const char *cp, const char *end);
+static int text_write(wri_doc_t *doc, const char *cp, size_t n);
+static int text_putc(wri_doc_t *doc, int c);
+static char *text_room(wri_doc_t *doc, size_t *availp);
+static int spill_text(wri_doc_t *doc);
+static int flush_text(wri_doc_t *doc);
+static int copy_file(FILE *ifp, FILE *ofp, FC nbytes, char *buf);
+#if defined(__linux__)
+static int write_blocks(wri_doc_t *doc, int fd);
+#endif
 
 /*
- * We memorise the text in a temporary file, because it is potentially very
- * large.  We could write it in the final output file, leaving a space for the
- * header, if we knew the name of the output file...
+ * We memorise the text in memory, in a chain of large blocks that grows as
+ * text is appended.  Most documents are small enough for this, and it saves
+ * passing every character through stdio.  If the text grows beyond
+ * text.memory bytes, it is moved into a temporary file, and from then on the
+ * last block is used as a buffer for writing to the end of the file.
+ * If we know the name of the output file in advance (see wri_begin() in
+ * save.c) the text is written straight into the output file instead, after
+ * the space for the header.
  */
+#define TEXT_BLOCK_SIZE 65536
 
-/* Stdio file pointer for temporary file. NULL means we haven't got one. */
-static FILE *text_fp = NULL;
+struct text_block {
+    struct text_block *next;	/* Next block in chain, NULL for the last */
+    size_t used;		/* How many bytes of data[] are occupied */
+    char data[TEXT_BLOCK_SIZE];
+};
 
-/* Public data */
-CP _wri_cpMac = 0;	/* Number of bytes of actual text */
-char _wri_last_char_read; /* Last char read when appending from Write file. */
-int _wri_in_rhc = 0; /* Are we defining a running head code? (Set in pap.c) */
-int _wri_had_normal_text = 0; /* Have we output non-rhc text yet? */
+static void free_text_blocks(struct text_block *from);
+
+/* The chain of blocks of text of a document starts at text.first and ends
+ * at text.last.  When the text is in the temp file, text.fp, there is only
+ * one block, holding the text that follows what is in the file.
+ */
+
+/* How much text to hold in memory before moving it to a temp file */
+#define DEFAULT_TEXT_MEMORY (4L * 1024 * 1024)
+
+/*
+ * Set the amount of text that is kept in memory before it is moved to a
+ * temporary file.  0 means always use a temporary file.
+ */
+int
+wri_text_memory_r(wri_doc_t *doc, long nbytes)
+{
+    if (nbytes < 0) return(1);
+
+    doc->text.memory = (CP) nbytes;
+    return(0);
+}
 
 /* User interface */
 int
-wri_text(char *text)
+wri_text_r(wri_doc_t *doc, const char *text)
 {
-    char *cp;
+    return(wri_text_n_r(doc, text, strlen(text)));
+}
 
-    /* Do we need to initialise ourselves? */
-    if (text_fp == NULL) {
-	if(create_tempfile()) return(1);
-    }
+/*
+ * Append <len> characters of text, which need not be nul-terminated.
+ * The text is only read, never copied or modified.
+ */
+int
+wri_text_n_r(wri_doc_t *doc, const char *text, size_t len)
+{
+    const char *end = text + len;
 
     /* Special treatment for character \001, the page number, which is only
      * valid inside running head codes, and which needs the fSpecial bit set
      * in its CHP.
      */
-    if (_wri_in_rhc) {
+    if (doc->text.in_rhc) {
+	const char *cp;
+
 	/* Can't define a header after you've already output normal text */
-	if (_wri_had_normal_text) return(1);
+	if (doc->text.had_normal_text) return(1);
 
 	/*
 	 * Do special handling of (page number) since it requires its own CHP
-	 * with the fSpecial bit set.
+	 * with the fSpecial bit set: output the text that precedes each \001,
+	 * then the \001 with its own CHP, and carry on after it.
 	 */
-	if ((cp = strchr(text, '\001')) != NULL) {
-	    /* Output preceding text, then the 001, then the following text. */
-	    char *copy = strdup(text);	/* Constant strings may be read-only */
-
-	    *(strchr(copy, '\001')) = '\0';
-	    if (do_text(copy)) { free(copy); return 1; }
-	    free(copy);
-
-	    if (_wri_chp_special(1) ||
-		do_text("\001") ||
-		_wri_chp_special(0)) return(1);
+	while ((cp = memchr(text, '\001', (size_t)(end - text))) != NULL) {
+	    if (do_text(doc, text, (size_t)(cp - text)) ||
+		_wri_chp_special(doc, 1) ||
+		do_text(doc, cp, (size_t)1) ||
+		_wri_chp_special(doc, 0)) return(1);
 
-	    return(wri_text(cp+1)); /* recursive call to process other \001s */
+	    text = cp + 1;
 	}
     }
 
-    return(do_text(text));
+    return(do_text(doc, text, (size_t)(end - text)));
 }
 
 /*
  *	Separate function really outputs the text, required because of treatment
  *	of \001 in wri_text
+ *
+ *	Almost all text is printable, so we look for the next control character
+ *	with find_special() and copy the run of ordinary characters before it in
+ *	one go.  Only the control characters themselves go through the switch.
  */
 static int
-do_text(char *text)
+do_text(wri_doc_t *doc, const char *text, size_t len)
 {
-    char *cp;
+    const char *cp = text;
+    const char *end = text + len;
+
+    while (cp < end) {
+	const char *special = find_special(cp, end);
+
+	if (special > cp) {
+	    /* A run of ordinary characters */
+	    if (text_write(doc, cp, (size_t)(special - cp))) return(1);
+	    doc->text.cpMac += special - cp;
+	    cp = special;
+	    continue;
+	}
 
-    for (cp=text; *cp; cp++) {
 	switch (*cp) {
 	/* They can specify \n or \r\n or even \n\r and we do the right thing
 	 * by ignoring \r and outputting \r\n for every \n in the input. */
 	case '\r':
 	    /* Ignore \r */
+	    cp++;
 	    continue;
 	case '\n':
 	    /* Insert \r */
-	    if (putc('\r', text_fp) != '\r') return(1);
-	    _wri_cpMac++;
+	    if (text_putc(doc, '\r')) return(1);
+	    doc->text.cpMac++;
 	    break;  /* Followed by the \n... */
 
 	case '\f':
@@ -114,127 +181,586 @@ do_text(char *text)
 
 	case '\001':
 	    /* Accept page number if inside running header or footer */
-	    if (!_wri_in_rhc) continue;
+	    if (!doc->text.in_rhc) { cp++; continue; }
 	    break;
 
 	default:
 	    /* Reject all other control characters */
-	    if ((*cp & ~31) == 0) continue;
-
-	    /* Everything else is ok */
-	    break;
+	    cp++;
+	    continue;
 	}
 
-	/* Put char to file.  Characters over 127 need to be converted to int
-	 * by hand otherwise they get converted to a negative value. */
-	if (putc(*cp, text_fp) != (*cp & 255)) {
-#ifdef _WINDOWS
-	    char szmess[80];
-	    wsprintf(szmess, "Error putting char %d", *cp);
-	    MessageBox( 0, szmess, "WriteKit in error", MB_OK|MB_ICONSTOP );
-#else
-	    fprintf(stderr, "Error putting char %d\n", *cp);
-#endif	    
-	    
-	    _wri_error = 1;  /* fatal error */
-	    return(1);
-	}
-	_wri_cpMac++;
+	/* Put char into the text store */
+	if (text_putc(doc, *cp)) return(1);
+	doc->text.cpMac++;
 
 	/* Start new paragraph? */
 	switch (*cp) {
 	case '\n':
 	case '\f':		/* page break also implies new paragraph */
-	    _wri_extend_pap((CP) _wri_cpMac);
-	    if(_wri_new_paragraph()) return(1);
+	    _wri_extend_pap(doc, doc->text.cpMac);
+	    if(_wri_new_paragraph(doc)) return(1);
 	    break;
 	}
+	cp++;
     }
 
     /* Inform the current CHP and PAP that they should cover these characters */
-    _wri_extend_chp((CP) _wri_cpMac);
-    _wri_extend_pap((CP) _wri_cpMac);
+    _wri_extend_chp(doc, doc->text.cpMac);
+    _wri_extend_pap(doc, doc->text.cpMac);
+
+    if (!doc->text.in_rhc) doc->text.had_normal_text = 1;
+
+    return(0);
+}
+
+/*
+ * Return a pointer to the first control character (0-31) in [cp, end),
+ * or end if there is none.  Characters 128-255 are ordinary Windows
+ * characters.
+ *
+ * With SSE2 or AVX2 we test 16 or 32 characters at a time; otherwise we test
+ * a long's worth at a time, using the trick that (x - 0x2020...) & ~x has the
+ * top bit set in every byte of x that is less than 0x20 (and maybe in bytes
+ * that follow it, which is why we look for the first one).
+ */
+static const char *
+find_special(const char *cp, const char *end)
+{
+#if defined(__AVX2__)
+    const __m256i limit = _mm256_set1_epi8(31);
+
+    while (end - cp >= 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *) cp);
+	/* Bytes equal to min(x, 31) are those <= 31 */
+	unsigned mask = (unsigned) _mm256_movemask_epi8(
+		_mm256_cmpeq_epi8(_mm256_min_epu8(x, limit), x));
+
+	if (mask != 0) return(cp + __builtin_ctz(mask));
+	cp += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i limit16 = _mm_set1_epi8(31);
+
+    while (end - cp >= 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *) cp);
+	unsigned mask = (unsigned) _mm_movemask_epi8(
+		_mm_cmpeq_epi8(_mm_min_epu8(x, limit16), x));
+
+	if (mask != 0) return(cp + __builtin_ctz(mask));
+	cp += 16;
+    }
+#else
+    /* Every byte of ONES is 0x01 */
+# define ONES ((unsigned long)-1 / 255)
+
+    while ((size_t)(end - cp) >= sizeof(unsigned long)) {
+	unsigned long x;
+
+	memcpy(&x, cp, sizeof(x));
+	if (((x - ONES * 0x20) & ~x & (ONES * 0x80)) != 0) break;
+	cp += sizeof(x);
+    }
+#endif
+
+    /* Finish off byte by byte */
+    while (cp < end && (*cp & ~31) != 0) cp++;
+
+    return(cp);
+}
+
+/*
+ * Append a run of characters to the text, filling the last block and
+ * adding more blocks as necessary.
+ */
+static int
+text_write(wri_doc_t *doc, const char *cp, size_t n)
+{
+    while (n > 0) {
+	char *room;
+	size_t avail;
 
-    if (!_wri_in_rhc) _wri_had_normal_text = 1;
+	if ((room = text_room(doc, &avail)) == NULL) return(1);
+	if (avail > n) avail = n;
+
+	memcpy(room, cp, avail);
+	doc->text.last->used += avail;
+	cp += avail;
+	n -= avail;
+    }
 
     return(0);
 }
 
+/*
+ * Append one character to the text.  The usual case, when there is room in
+ * the last block, is done inline.
+ */
 static int
-create_tempfile()
-{		       
-    text_fp = tmpfile();  
+text_putc(wri_doc_t *doc, int c)
+{
+    char *room;
+    size_t avail;
 
-    if (text_fp == NULL) {
-	return(1);
+    if (doc->text.last != NULL && doc->text.last->used < TEXT_BLOCK_SIZE) {
+	doc->text.last->data[doc->text.last->used++] = c;
+	return(0);
     }
 
-    /* The temp file is created in binary read/write mode */
+    if ((room = text_room(doc, &avail)) == NULL) return(1);
+    *room = c;
+    doc->text.last->used++;
 
     return(0);
 }
 
-int
-_wri_save_text(struct wri_header *hp, FILE *ofp)
+/*
+ * Return a pointer to the free space at the end of the text, making sure that
+ * there is some, and set *availp to the number of bytes available there.
+ * The caller fills it and adds what it wrote to text.last->used.
+ */
+static char *
+text_room(wri_doc_t *doc, size_t *availp)
 {
-    char page[PAGESIZE];/* Buffer for transfer of data */
-    FC nbytes_to_go;	    /* How many bytes remain to be copied from the temp file
-			 * to the output file? */
+    if (doc->text.last == NULL || doc->text.last->used == TEXT_BLOCK_SIZE) {
+	if (doc->text.fp == NULL && doc->text.cpMac >= doc->text.memory) {
+	    /* Too big to keep in memory: move it all to a temp file */
+	    if (spill_text(doc)) return(NULL);
+	}
 
-    hp->fcMac = _wri_cpMac + PAGESIZE;
+	if (doc->text.fp != NULL && doc->text.last != NULL) {
+	    /* Last block is the buffer for the temp file: empty it */
+	    if (flush_text(doc)) return(NULL);
+	} else {
+	    /* Add a new block to the chain */
+	    struct text_block *new;
 
-    if (_wri_cpMac == 0) {
-	/* No text, hence no temp file either */
-	return(0);
+	    new = (struct text_block *) malloc(sizeof(struct text_block));
+	    if (new == NULL) {
+		doc->error = 1;	/* Fatal error */
+		return(NULL);
+	    }
+	    new->next = NULL;
+	    new->used = 0;
+
+	    if (doc->text.last == NULL) doc->text.first = new;
+	    else doc->text.last->next = new;
+	    doc->text.last = new;
+	}
     }
 
-    if (_wri_seek_to_page((PN)1, ofp)) return(1);
+    *availp = TEXT_BLOCK_SIZE - doc->text.last->used;
+    return(&(doc->text.last->data[doc->text.last->used]));
+}
 
-    rewind(text_fp);
+/*
+ * Move the text from the chain of blocks into a temporary file, keeping the
+ * last block as a buffer for the text that follows.
+ */
+static int
+spill_text(wri_doc_t *doc)
+{
+    struct text_block *tbp;
 
-    /* rewind can imply writing of last block, but never returns failure.
-     * Only ferror() can tell us if this last write failed.
-     */
-    if (ferror(text_fp)) {
-	_wri_error = 1;
+    doc->text.fp = tmpfile();
+    if (doc->text.fp == NULL) {
+	doc->error = 1;
 	return(1);
     }
+    /* The temp file is created in binary read/write mode */
+
+    doc->text.fp_len = 0;
+    for (tbp = doc->text.first; tbp != NULL; tbp = tbp->next) {
+	if (fwrite(tbp->data, (size_t)1, tbp->used, doc->text.fp) != tbp->used) {
+	    doc->error = 1;
+	    return(1);
+	}
+	doc->text.fp_len += tbp->used;
+    }
+
+    /* Keep the last block, free the rest */
+    if (doc->text.last != NULL) {
+	struct text_block *next;
+
+	for (tbp = doc->text.first; tbp != doc->text.last; tbp = next) {
+	    next = tbp->next;
+	    free((char *) tbp);
+	}
+	doc->text.first = doc->text.last;
+	doc->text.last->used = 0;
+    }
 
-    /* Can't simply copy the whole file because if the reading of a write file
-     * fails, the temporary file may have extra bogus text left at the end.
-     * Use _wri_cpMac instead.
+    return(0);
+}
+
+/*
+ * Write the contents of the buffer block to the end of the temp file.
+ * After a rollback, the file may be longer than the significant text, so
+ * always seek to the end of the significant part first.
+ */
+static int
+flush_text(wri_doc_t *doc)
+{
+    struct text_block *bp = doc->text.last;
+
+    if (bp->used == 0) return(0);
+
+    if (fseek(doc->text.fp, (long) (doc->text.fp_base + doc->text.fp_len),
+	      SEEK_SET) != 0 ||
+	fwrite(bp->data, (size_t)1, bp->used, doc->text.fp) != bp->used) {
+	doc->error = 1;
+	return(1);
+    }
+    doc->text.fp_len += bp->used;
+    bp->used = 0;
+
+    return(0);
+}
+
+/*
+ * Copy <nbytes> from the current position of <ifp> to the current position of
+ * <ofp>, leaving both positioned after what was copied.
+ * On Linux, we get the kernel to do it with copy_file_range(), or failing
+ * that with sendfile(), so that the text never comes into user space.
+ * Elsewhere, or if neither works for these files, we copy it through <buf>,
+ * which is TEXT_BLOCK_SIZE bytes long.
+ */
+static int
+copy_file(FILE *ifp, FILE *ofp, FC nbytes, char *buf)
+{
+#if defined(__linux__)
+    long in_pos, out_pos;   /* Where we are copying from and to */
+    int use_sendfile = 0;   /* Has copy_file_range() let us down? */
+
+    /* We use the file descriptors with explicit offsets, so stdio's idea of
+     * the positions must be up to date, and anything it has buffered must be
+     * in the files.
      */
-    nbytes_to_go = _wri_cpMac;
-    do {
-	size_t block;	/* How many bytes to read in each operation */
-	size_t nbytes_read;	/* How many were actually read from the file */
-
-	block = (size_t) min(nbytes_to_go, (FC) PAGESIZE);
-	nbytes_read = fread(page, (size_t)1, block, text_fp);
-	if (nbytes_read != block) {
-	    _wri_error = 1;
+    if ((in_pos = ftell(ifp)) < 0 || (out_pos = ftell(ofp)) < 0 ||
+	fflush(ifp) != 0 || fflush(ofp) != 0) return(1);
+
+    while (nbytes > 0) {
+	loff_t off_in = in_pos, off_out = out_pos;
+	ssize_t n;
+
+	if (!use_sendfile) {
+	    n = copy_file_range(fileno(ifp), &off_in, fileno(ofp), &off_out,
+				(size_t) nbytes, 0);
+	    if (n < 0 && (errno == ENOSYS || errno == EXDEV ||
+			  errno == EINVAL || errno == EOPNOTSUPP)) {
+		/* Not for these files - try the other way */
+		use_sendfile = 1;
+		continue;
+	    }
+	} else {
+	    /* sendfile() writes at the output file's own offset */
+	    if (lseek(fileno(ofp), (off_t) out_pos, SEEK_SET) < 0) break;
+	    n = sendfile(fileno(ofp), fileno(ifp), &off_in, (size_t) nbytes);
+	}
+	if (n <= 0) break;	/* Copy what's left by hand */
+
+	in_pos += n;
+	out_pos += n;
+	nbytes -= n;
+    }
+
+    /* Tell stdio where we have got to */
+    if (fseek(ifp, in_pos, SEEK_SET) != 0 ||
+	fseek(ofp, out_pos, SEEK_SET) != 0) return(1);
+#endif
+
+    while (nbytes > 0) {
+	size_t block;	/* How many bytes to copy in each operation */
+
+	block = (size_t) min(nbytes, (FC) TEXT_BLOCK_SIZE);
+	if (fread(buf, (size_t)1, block, ifp) != block ||
+	    fwrite(buf, (size_t)1, block, ofp) != block) return(1);
+	nbytes -= block;
+    }
+
+    return(0);
+}
+
+static void
+free_text_blocks(struct text_block *from)
+{
+    struct text_block *tbp;
+
+    for (tbp = from; tbp != NULL; /* re-init in loop body */) {
+	struct text_block *next;
+
+	/* Need to keep hold of next pointer because free() may corrupt it */
+	next = tbp->next;
+	free((char *) tbp);
+	tbp = next;
+    }
+}
+
+/*
+ * Write the text into the document being saved, from page 1 on.
+ * Into a file we copy it the fastest way the system has; anywhere else it
+ * goes through _wri_sink_write() in order, a block at a time.
+ */
+int
+_wri_save_text(wri_doc_t *doc, struct sink *sp)
+{
+    struct text_block *tbp;
+    FC offset = PAGESIZE;	/* Where the next byte of text goes */
+
+    if (doc->text.cpMac == 0) {
+	/* No text, hence no blocks either */
+	return(0);
+    }
+
+    if (doc->text.fp != NULL) {
+	FC left;	/* Bytes of text still to copy */
+
+	/* Put the buffered text in the file, then copy it all from there,
+	 * using the buffer block for the transfer.
+	 */
+	if (flush_text(doc)) return(1);
+	left = doc->text.fp_len;
+
+	/* If we are writing the text straight into the output file, it's
+	 * already where it should be. */
+	if (doc->text.fp == sp->fp) return(0);
+
+	if (sp->fp != NULL && _wri_seek_to_page(doc, (PN)1, sp->fp)) return(1);
+
+	/* fseek can imply writing of last block, but failure of that does not
+	 * make it fail.  Only ferror() can tell us if this last write failed.
+	 */
+	if (fseek(doc->text.fp, (long) doc->text.fp_base, SEEK_SET) != 0 ||
+	    ferror(doc->text.fp)) {
+	    doc->error = 1;
 	    return(1);
 	}
-	if (fwrite(page, (size_t)1, (size_t)nbytes_read, ofp) != (size_t)nbytes_read) {
-	    _wri_error = 1;
+
+	/* Can't simply copy the whole file because if the reading of a write
+	 * file fails, the temporary file may have extra bogus text left at the
+	 * end.  Use text.fp_len instead.
+	 */
+	if (sp->fp != NULL) {
+	    if (copy_file(doc->text.fp, sp->fp, left, doc->text.last->data)) {
+		doc->error = 1;
+		return(1);
+	    }
+	    return(0);
+	}
+
+	while (left > 0) {
+	    size_t block = (size_t) min(left, (FC) TEXT_BLOCK_SIZE);
+
+	    if (fread(doc->text.last->data, (size_t)1, block,
+		      doc->text.fp) != block) {
+		doc->error = 1;
+		return(1);
+	    }
+	    if (_wri_sink_write(doc, sp, offset, doc->text.last->data, block))
+		return(1);
+	    offset += block;
+	    left -= block;
+	}
+
+	return(0);
+    }
+
+    /* The text is all in memory: write the blocks straight out */
+#if defined(__linux__)
+    if (sp->fp != NULL) {
+	if (write_blocks(doc, fileno(sp->fp))) {
+	    doc->error = 1;
 	    return(1);
 	}
-	nbytes_to_go -= nbytes_read;
-    } while (nbytes_to_go > 0);
+	return(0);
+    }
+#endif
+
+    for (tbp = doc->text.first; tbp != NULL; tbp = tbp->next) {
+	if (_wri_sink_write(doc, sp, offset, tbp->data, tbp->used)) return(1);
+	offset += tbp->used;
+    }
 
     return(0);
 }
 
+/*
+ * Write <len> bytes of the text, from <cp> on, into the document being saved,
+ * for wri_save_step().  Each call usually carries on where the last one left
+ * off, so we remember which block that was rather than looking for it again.
+ */
 int
-_wri_reinit_text()
-{			   
-    if (text_fp != NULL) fclose(text_fp);
-    
-    text_fp = NULL;
+_wri_save_text_part(wri_doc_t *doc, struct sink *sp, CP cp, CP len)
+{
+    struct text_block *tbp;
+    CP block_cp;	/* cp of the start of *tbp */
+
+    if (len == 0) return(0);
+
+    if (doc->text.fp != NULL) {
+	/* The first time, put the buffered text in the file with the rest */
+	if (cp == 0 && flush_text(doc)) return(1);
+
+	if (doc->text.fp == sp->fp) return(0);
+
+	if (fseek(doc->text.fp, (long) (doc->text.fp_base + cp), SEEK_SET) != 0 ||
+	    ferror(doc->text.fp)) {
+	    doc->error = 1;
+	    return(1);
+	}
+
+	if (sp->fp != NULL) {
+	    if (fseek(sp->fp, (long) (PAGESIZE + cp), SEEK_SET) != 0 ||
+		ferror(sp->fp) ||
+		copy_file(doc->text.fp, sp->fp, len, doc->text.last->data)) {
+		doc->error = 1;
+		return(1);
+	    }
+	    return(0);
+	}
+
+	while (len > 0) {
+	    size_t block = (size_t) min(len, (CP) TEXT_BLOCK_SIZE);
+
+	    if (fread(doc->text.last->data, (size_t)1, block,
+		      doc->text.fp) != block) {
+		doc->error = 1;
+		return(1);
+	    }
+	    if (_wri_sink_write(doc, sp, (FC) PAGESIZE + cp,
+				doc->text.last->data, block)) return(1);
+	    cp += block;
+	    len -= block;
+	}
+
+	return(0);
+    }
+
+    if (cp == 0 || doc->text.save_block == NULL || cp < doc->text.save_cp) {
+	tbp = doc->text.first;
+	block_cp = 0;
+    } else {
+	tbp = doc->text.save_block;
+	block_cp = doc->text.save_cp;
+    }
+    while (tbp != NULL && block_cp + tbp->used <= cp) {
+	block_cp += tbp->used;
+	tbp = tbp->next;
+    }
 
-    _wri_cpMac = 0;
-    _wri_had_normal_text = 0;
-    _wri_in_rhc = 0;
+    while (len > 0 && tbp != NULL) {
+	size_t offset = (size_t) (cp - block_cp);	/* Where cp is in *tbp */
+	size_t n = (size_t) min((CP) (tbp->used - offset), len);
+
+	if (_wri_sink_write(doc, sp, (FC) PAGESIZE + cp, tbp->data + offset, n))
+	    return(1);
+	cp += n;
+	len -= n;
+	if (offset + n == tbp->used) {
+	    block_cp += tbp->used;
+	    tbp = tbp->next;
+	}
+    }
+
+    doc->text.save_block = tbp;
+    doc->text.save_cp = block_cp;
+
+    return(0);
+}
+
+#if defined(__linux__)
+/*
+ * Write the blocks of text into the file from page 1 on, as many at a time as
+ * the system lets us, so that a document of a few megabytes goes in one
+ * system call.
+ */
+#define WRITE_IOV 1024	/* Blocks to write at once, the most Linux allows */
+
+static int
+write_blocks(wri_doc_t *doc, int fd)
+{
+    struct iovec iov[WRITE_IOV];
+    struct text_block *tbp = doc->text.first;
+    off_t offset = PAGESIZE;
+
+    while (tbp != NULL) {
+	int n = 0;	/* Number of blocks in iov */
+	int k = 0;	/* Number of them already written */
+
+	for (; tbp != NULL && n < WRITE_IOV; tbp = tbp->next) {
+	    if (tbp->used == 0) continue;
+	    iov[n].iov_base = tbp->data;
+	    iov[n].iov_len = tbp->used;
+	    n++;
+	}
+
+	while (k < n) {
+	    ssize_t done = pwritev(fd, &iov[k], n - k, offset);
+
+	    if (done < 0 && errno == EINTR) continue;
+	    if (done <= 0) return(1);
+	    offset += done;
+
+	    /* Skip what was written, which may end part way through a block */
+	    while (k < n && (size_t) done >= iov[k].iov_len) {
+		done -= iov[k].iov_len;
+		k++;
+	    }
+	    if (k < n) {
+		iov[k].iov_base = (char *) iov[k].iov_base + done;
+		iov[k].iov_len -= done;
+	    }
+	}
+    }
+
+    return(0);
+}
+#endif
+
+void
+_wri_init_text(wri_doc_t *doc)
+{
+    doc->text.memory = DEFAULT_TEXT_MEMORY;
+}
+
+int
+_wri_reinit_text(wri_doc_t *doc)
+{
+    free_text_blocks(doc->text.first);
+    doc->text.first = doc->text.last = NULL;
+
+    /* The output file, if we were writing into it, belongs to save.c */
+    if (doc->text.fp != NULL && !doc->text.direct) fclose(doc->text.fp);
+
+    doc->text.fp = NULL;
+    doc->text.fp_len = 0;
+    doc->text.fp_base = 0;
+    doc->text.direct = 0;
+
+    doc->text.save_block = NULL;
+    doc->text.save_cp = 0;
+
+    doc->text.cpMac = 0;
+    doc->text.had_normal_text = 0;
+    doc->text.in_rhc = 0;
+
+    return(0);
+}
+
+/*
+ * Write the text straight into the output file <ofp>, starting at page 1,
+ * as it arrives.  Called by wri_begin() when there is no text yet.
+ */
+int
+_wri_direct_text(wri_doc_t *doc, FILE *ofp)
+{
+    if (doc->text.cpMac != 0 || doc->text.fp != NULL) return(1);
+
+    doc->text.fp = ofp;
+    doc->text.fp_base = PAGESIZE;
+    doc->text.fp_len = 0;
+    doc->text.direct = 1;
 
     return(0);
 }
@@ -242,34 +768,214 @@ _wri_reinit_text()
 /*
  * Raw interface: read n_to_read chars from an already-open and positioned
  * file pointer.
- * Side-effects _wri_last_char_read to the value of the last char in the file.
+ * Side-effects text.last_char_read to the value of the last char in the file.
  */
 
 int
-_wri_append_text(FILE *ifp, CP n_to_read)
+_wri_append_text(wri_doc_t *doc, FILE *ifp, CP n_to_read)
 {
     CP n_read;	    /* Number of bytes transferred so far */
-    int c;
+    char *room;	    /* Where to put them */
+    size_t avail;   /* and how many will fit there */
+
+    if (n_to_read == 0) return(0);
 
-    /* Do we need to initialise ourselves? */
-    if (text_fp == NULL) {
-	if(create_tempfile()) return(1);
+    /* If the text will be too big for memory, put it in a file now */
+    if (doc->text.fp == NULL &&
+	doc->text.cpMac + n_to_read > doc->text.memory) {
+	if (spill_text(doc)) return(1);
     }
 
-    for (n_read = 0; n_read < n_to_read; n_read++) {
-	c = getc(ifp);
-	if (c == EOF || putc(c, text_fp) != c) return(1);
+    if (doc->text.fp != NULL) {
+	/* Empty the buffer into the file, then copy the new text straight
+	 * from one file to the other, using the buffer if we have to.
+	 */
+	if (text_room(doc, &avail) == NULL || flush_text(doc) ||
+	    fseek(doc->text.fp, (long) (doc->text.fp_base + doc->text.fp_len),
+		  SEEK_SET) != 0 ||
+	    copy_file(ifp, doc->text.fp, n_to_read, doc->text.last->data)) return(1);
+	doc->text.fp_len += n_to_read;
+	doc->text.cpMac += n_to_read;
+
+	/* Go back for the last significant character, for read.c */
+	if (fseek(ifp, -1L, SEEK_CUR) != 0) return(1);
+	doc->text.last_char_read = (char) getc(ifp);
 
+	/* Can't define a running head code now that we've had text. */
+	doc->text.had_normal_text = 1;
+
+	return(0);
     }
 
-    /* Remember the last significant character for read.c's benefit */
-    _wri_last_char_read = (char) c;
+    for (n_read = 0; n_read < n_to_read; n_read += avail) {
+	if ((room = text_room(doc, &avail)) == NULL) return(1);
+	avail = (size_t) min((CP) avail, n_to_read - n_read);
+
+	if (fread(room, (size_t)1, avail, ifp) != avail) return(1);
+	doc->text.last->used += avail;
+
+	/* Remember the last significant character for read.c's benefit */
+	doc->text.last_char_read = room[avail - 1];
+
+	/* Keep text.cpMac in step, as text_room() looks at it */
+	doc->text.cpMac += avail;
+    }
+
+    /* Can't define a running head code now that we've had text. */
+    doc->text.had_normal_text = 1;
 
-    /* Increment _wri_cpMac to cover the new bytes read in */
-    _wri_cpMac += n_to_read;
+    return(0);
+}
+
+/*
+ * The same, taking the text from memory: from a Write file that read.c has
+ * mapped, for instance.
+ */
+int
+_wri_append_text_mem(wri_doc_t *doc, char *buf, CP n_to_read)
+{
+    CP n_read;	    /* Number of bytes transferred so far */
+    char *room;	    /* Where to put them */
+    size_t avail;   /* and how many will fit there */
+
+    if (n_to_read == 0) return(0);
+
+    /* If the text will be too big for memory, put it in a file now */
+    if (doc->text.fp == NULL &&
+	doc->text.cpMac + n_to_read > doc->text.memory) {
+	if (spill_text(doc)) return(1);
+    }
+
+    if (doc->text.fp != NULL) {
+	/* Empty the buffer into the file and write the new text after it */
+	if (text_room(doc, &avail) == NULL || flush_text(doc) ||
+	    fseek(doc->text.fp, (long) (doc->text.fp_base + doc->text.fp_len),
+		  SEEK_SET) != 0 ||
+	    fwrite(buf, (size_t)1, (size_t) n_to_read, doc->text.fp) !=
+		(size_t) n_to_read) {
+	    doc->error = 1;
+	    return(1);
+	}
+	doc->text.fp_len += n_to_read;
+	doc->text.cpMac += n_to_read;
+    } else {
+	for (n_read = 0; n_read < n_to_read; n_read += avail) {
+	    if ((room = text_room(doc, &avail)) == NULL) return(1);
+	    avail = (size_t) min((CP) avail, n_to_read - n_read);
+
+	    memcpy(room, buf + n_read, avail);
+	    doc->text.last->used += avail;
+	    doc->text.cpMac += avail;
+	}
+    }
+
+    /* Remember the last significant character for read.c's benefit */
+    doc->text.last_char_read = buf[n_to_read - 1];
 
     /* Can't define a running head code now that we've had text. */
-    _wri_had_normal_text = 1;
+    doc->text.had_normal_text = 1;
+
+    return(0);
+}
+
+/*
+ * Append the text of the fragment <frag> to that of <doc>, for wri_splice().
+ * If both are in memory and the fragment has at least half a block of text,
+ * its blocks are simply moved onto the end of the chain, which leaves the
+ * fragment with no text.  A smaller fragment is copied into the room left in
+ * <doc>'s blocks, so that splicing many small ones doesn't use a block
+ * apiece.  Otherwise the text is copied into <doc>'s temp file.
+ */
+int
+_wri_splice_text(wri_doc_t *doc, wri_doc_t *frag)
+{
+    CP n = frag->text.cpMac;
+
+    if (n == 0) return(0);
+
+    if (doc->text.fp == NULL && frag->text.fp == NULL &&
+	doc->text.cpMac + n <= doc->text.memory) {
+	if (n >= TEXT_BLOCK_SIZE / 2) {
+	    /* Move the blocks */
+	    if (doc->text.last == NULL) doc->text.first = frag->text.first;
+	    else doc->text.last->next = frag->text.first;
+	    doc->text.last = frag->text.last;
+	    frag->text.first = frag->text.last = NULL;
+	} else {
+	    struct text_block *tbp;
+
+	    for (tbp = frag->text.first; tbp != NULL; tbp = tbp->next) {
+		if (text_write(doc, tbp->data, tbp->used)) return(1);
+	    }
+	}
+    } else {
+	if (doc->text.fp == NULL && spill_text(doc)) return(1);
+
+	if (frag->text.fp == NULL) {
+	    struct text_block *tbp;
+
+	    for (tbp = frag->text.first; tbp != NULL; tbp = tbp->next) {
+		if (text_write(doc, tbp->data, tbp->used)) return(1);
+	    }
+	} else {
+	    size_t avail;
+
+	    /* Empty both buffers into their files, then copy from one file
+	     * to the other, using our buffer if we have to.
+	     */
+	    if (flush_text(frag) || text_room(doc, &avail) == NULL ||
+		flush_text(doc) ||
+		fseek(frag->text.fp, (long) frag->text.fp_base, SEEK_SET) != 0 ||
+		fseek(doc->text.fp, (long) (doc->text.fp_base + doc->text.fp_len),
+		      SEEK_SET) != 0 ||
+		copy_file(frag->text.fp, doc->text.fp, frag->text.fp_len,
+			  doc->text.last->data)) {
+		doc->error = 1;
+		return(1);
+	    }
+	    doc->text.fp_len += frag->text.fp_len;
+	}
+    }
+
+    doc->text.cpMac += n;
+    if (frag->text.had_normal_text) doc->text.had_normal_text = 1;
+
+    return(0);
+}
+
+/*
+ * Append a copy of the text of <frag>, which must all be in memory, leaving
+ * <frag> as it was, for wri_template_insert().
+ */
+int
+_wri_copy_text(wri_doc_t *doc, wri_doc_t *frag)
+{
+    struct text_block *tbp;
+
+    if (frag->text.fp != NULL) return(1);
+
+    for (tbp = frag->text.first; tbp != NULL; tbp = tbp->next) {
+	if (_wri_append_text_mem(doc, tbp->data, (CP) tbp->used)) return(1);
+    }
+
+    return(0);
+}
+
+/*
+ * Copy all the text of <doc>, which must be in memory, into <buf>, which
+ * has room for doc->text.cpMac characters.
+ */
+int
+_wri_get_text(wri_doc_t *doc, char *buf)
+{
+    struct text_block *tbp;
+
+    if (doc->text.fp != NULL) return(1);
+
+    for (tbp = doc->text.first; tbp != NULL; tbp = tbp->next) {
+	memcpy(buf, tbp->data, tbp->used);
+	buf += tbp->used;
+    }
 
     return(0);
 }
@@ -277,22 +983,65 @@ _wri_append_text(FILE *ifp, CP n_to_read)
 /*
  * Memorise the current quantity of text so as to be able to cancel it
  * if the reading of the write file subsequently fails.
- * We roll back simply by repositioning the file pointer, so beware of the
+ * We roll back simply by truncating the last block, so we remember which
+ * one it was, and how full it was.  If the text has since gone into the temp
+ * file, we truncate the significant part of the file instead, so beware of the
  * possibility that the temporary file may be longer than the number of
  * significant characters in it.
  */
 
-static CP cp_break;
-
 void
-_wri_breakpoint_text()
+_wri_breakpoint_text(wri_doc_t *doc)
 {
-    cp_break = _wri_cpMac;
+    doc->text.cp_break = doc->text.cpMac;
+    doc->text.block_break = doc->text.last;
+    doc->text.used_break = (doc->text.last != NULL) ? doc->text.last->used : 0;
 }
 
 void
-_wri_rollback_text()
+_wri_rollback_text(wri_doc_t *doc)
+{
+    if (doc->text.fp != NULL) {
+	/* After wri_begin() there may be no buffer yet, and so nothing in it
+	 * to cut */
+	if (doc->text.cp_break >= doc->text.fp_len) {
+	    if (doc->text.last != NULL)
+		doc->text.last->used = doc->text.cp_break - doc->text.fp_len;
+	} else {
+	    doc->text.fp_len = doc->text.cp_break;
+	    if (doc->text.last != NULL) doc->text.last->used = 0;
+	}
+    } else if (doc->text.block_break == NULL) {
+	/* There was no text at the breakpoint */
+	free_text_blocks(doc->text.first);
+	doc->text.first = doc->text.last = NULL;
+    } else {
+	free_text_blocks(doc->text.block_break->next);
+	doc->text.block_break->next = NULL;
+	doc->text.block_break->used = doc->text.used_break;
+	doc->text.last = doc->text.block_break;
+    }
+
+    doc->text.cpMac = doc->text.cp_break;
+}
+
+/*
+ *  The same functions, acting on the default document
+ */
+int
+wri_text(const char *text)
+{
+    return(wri_text_r(_wri_default_doc(), text));
+}
+
+int
+wri_text_n(const char *text, size_t len)
+{
+    return(wri_text_n_r(_wri_default_doc(), text, len));
+}
+
+int
+wri_text_memory(long nbytes)
 {
-    (void) fseek(text_fp, cp_break, SEEK_SET);
-    _wri_cpMac = cp_break;
+    return(wri_text_memory_r(_wri_default_doc(), nbytes));
 }